@@ -9,6 +9,10 @@ import sys
 
 CLANG_DB_NAME = "compile_commands.json"
 
+# Benchmarks that measure memory rather than time. They take none of the
+# harness's flags, and have no results for bench_compare.py.
+MEMORY_BENCHES = {"churn", "memory"}
+
 
 def wrapCommand(cmd):
     """Run the given command, as a list.
@@ -23,6 +27,12 @@ def wrapCommand(cmd):
 
 
 def main():
+    # Optionally, a directory to write each benchmark's JSON results to, for
+    # comparison with bench_compare.py.
+    outDir = os.path.abspath(sys.argv[1]) if len(sys.argv) > 1 else None
+    if outDir:
+        os.makedirs(outDir, exist_ok=True)
+
     if os.path.exists("build"):
         shutil.rmtree("build")
     os.mkdir("build")
@@ -42,7 +52,10 @@ def main():
 
     for bench in benches:
         stripped = os.path.basename(bench)[:-4]
-        wrapCommand([f"./{stripped}"])
+        cmd = [f"./{stripped}"]
+        if outDir and stripped not in MEMORY_BENCHES:
+            cmd += ["--json", os.path.join(outDir, f"{stripped}.json")]
+        wrapCommand(cmd)
         print("\n")
 
 
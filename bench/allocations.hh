@@ -0,0 +1,101 @@
+#pragma once
+
+// Counts every heap allocation the process makes, by interposing malloc and
+// friends on top of glibc's implementations. Include this from exactly one
+// translation unit of a benchmark.
+//
+// Allocations are measured by their usable size, so live bytes include the
+// allocator's rounding (but not its per-chunk headers).
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <malloc.h>
+#include <sys/resource.h>
+
+#ifndef __GLIBC__
+#error "allocations.hh interposes glibc's malloc"
+#endif
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *p, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+void __libc_free(void *p);
+}
+
+struct AllocationCounts {
+    std::uint64_t allocations = 0;
+    std::uint64_t frees = 0;
+    std::int64_t liveBytes = 0;
+    std::int64_t peakLiveBytes = 0;
+};
+
+static AllocationCounts allocationCounts;
+
+static inline void *countAllocation(void *p) {
+    if (p != NULL) {
+        allocationCounts.allocations++;
+        allocationCounts.liveBytes += malloc_usable_size(p);
+        if (allocationCounts.liveBytes > allocationCounts.peakLiveBytes) {
+            allocationCounts.peakLiveBytes = allocationCounts.liveBytes;
+        }
+    }
+    return p;
+}
+
+static inline void countFree(void *p) {
+    if (p != NULL) {
+        allocationCounts.frees++;
+        allocationCounts.liveBytes -= malloc_usable_size(p);
+    }
+}
+
+extern "C" {
+void *malloc(size_t size) { return countAllocation(__libc_malloc(size)); }
+
+void *calloc(size_t n, size_t size) {
+    return countAllocation(__libc_calloc(n, size));
+}
+
+void *realloc(void *p, size_t size) {
+    countFree(p);
+    return countAllocation(__libc_realloc(p, size));
+}
+
+void *memalign(size_t alignment, size_t size) {
+    return countAllocation(__libc_memalign(alignment, size));
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    return countAllocation(__libc_memalign(alignment, size));
+}
+
+int posix_memalign(void **result, size_t alignment, size_t size) {
+    void *p = countAllocation(__libc_memalign(alignment, size));
+    if (p == NULL) {
+        return ENOMEM;
+    }
+    *result = p;
+    return 0;
+}
+
+void free(void *p) {
+    countFree(p);
+    __libc_free(p);
+}
+}
+
+// Start measuring peak live bytes from the current level.
+inline void resetPeakLiveBytes() {
+    allocationCounts.peakLiveBytes = allocationCounts.liveBytes;
+}
+
+// The process's peak resident set size so far, in bytes.
+inline std::uint64_t peakRss() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return static_cast<std::uint64_t>(usage.ru_maxrss) * 1024;
+}
@@ -3,97 +3,236 @@
 #include "HAMT.hh"
 #include "bench.hh"
 
-template <typename Set> void benchmark() {
+struct Keys {
+    std::vector<std::string> toAdd;
+    std::vector<std::string> notToAdd;
+};
+
+Keys generateKeys() {
+    std::mt19937_64 generator(BENCH_SEED);
     std::unordered_set<std::string> setOfStringsToAdd;
-    std::vector<std::string> stringsToAdd;
+    Keys keys;
 
     for (int i = 0; i < 1000000; ++i) {
-        auto str = random_string();
+        auto str = random_string(generator);
 
         if (setOfStringsToAdd.find(str) != setOfStringsToAdd.end()) {
             continue;
         }
 
         setOfStringsToAdd.insert(str);
-        stringsToAdd.push_back(str);
+        keys.toAdd.push_back(str);
     }
 
-    std::vector<std::string> stringsNotToAdd;
-
     for (int i = 0; i < 1000000; ++i) {
-        auto str = random_string();
+        auto str = random_string(generator);
         if (setOfStringsToAdd.find(str) != setOfStringsToAdd.end()) {
             continue;
         }
 
-        stringsNotToAdd.push_back(str);
+        keys.notToAdd.push_back(str);
     }
 
+    return keys;
+}
+
+template <typename Set>
+void benchmark(Harness &harness, Keys keys, std::mt19937_64 &generator) {
     Set set;
 
-    int i = 0;
-    auto stringsToAddCopy = stringsToAdd;
-    auto iter = stringsToAddCopy.begin();
-    benchmark("Random string insertion", stringsToAdd.size(), [&]() -> void {
-        i++;
-        set.insert(std::move(*iter));
-        iter++;
-    });
-
-    iter = stringsNotToAdd.begin();
-    benchmark("Unsuccessful string lookup", stringsNotToAdd.size(),
-              [&]() -> void {
-                  set.find(*iter);
-                  iter++;
-              });
-
-    iter = stringsToAdd.begin();
-    benchmark("Successful string lookup", stringsToAdd.size(), [&]() -> void {
-        set.find(*iter);
-        iter++;
-    });
-
-    std::random_shuffle(stringsToAdd.begin(), stringsToAdd.end());
-    std::random_shuffle(stringsNotToAdd.begin(), stringsNotToAdd.end());
-
-    iter = stringsNotToAdd.begin();
-    benchmark("Unsuccessful string lookup (shuffled)", stringsNotToAdd.size(),
-              [&]() -> void {
-                  set.find(*iter);
-                  iter++;
-              });
-
-    iter = stringsToAdd.begin();
-    benchmark("Successful string lookup (shuffled)", stringsToAdd.size(),
-              [&]() -> void {
-                  set.find(*iter);
-                  iter++;
-              });
-
-    iter = stringsNotToAdd.begin();
-    benchmark("Unsuccessful string deletion (shuffled)",
-              stringsNotToAdd.size() / 2, [&]() -> void {
-                  set.erase(*iter);
-                  iter++;
-              });
-
-    iter = stringsToAdd.begin();
-    benchmark("Successful string deletion (shuffled)", stringsToAdd.size() / 2,
-              [&]() -> void {
-                  set.erase(*iter);
-                  iter++;
-              });
+    auto &toAdd = keys.toAdd;
+    auto &notToAdd = keys.notToAdd;
+
+    auto toAddCopy = toAdd;
+    harness.measure("Random string insertion", toAdd.size(),
+                    [&](size_t i) { set.insert(std::move(toAddCopy[i])); });
+
+    {
+        // The reservation is made inside the timed loop, so that its cost is
+        // counted too.
+        Set reserved;
+        toAddCopy = toAdd;
+        harness.measure("Random string insertion (reserved)", toAdd.size(),
+                        [&](size_t i) {
+                            if (i == 0) {
+                                reserved.reserve(toAdd.size());
+                            }
+                            reserved.insert(std::move(toAddCopy[i]));
+                        });
+    }
+
+    harness.measure("Unsuccessful string lookup", notToAdd.size(),
+                    [&](size_t i) { return contains(set, notToAdd[i]); });
+
+    harness.measure("Successful string lookup", toAdd.size(),
+                    [&](size_t i) { return contains(set, toAdd[i]); });
+
+    std::shuffle(toAdd.begin(), toAdd.end(), generator);
+    std::shuffle(notToAdd.begin(), notToAdd.end(), generator);
+
+    harness.measure("Unsuccessful string lookup (shuffled)", notToAdd.size(),
+                    [&](size_t i) { return contains(set, notToAdd[i]); });
+
+    harness.measure("Successful string lookup (shuffled)", toAdd.size(),
+                    [&](size_t i) { return contains(set, toAdd[i]); });
+
+    if constexpr (std::is_same_v<Set, Hamt>) {
+        set.compact();
+
+        harness.measure("Successful string lookup (shuffled, compacted)",
+                        toAdd.size(),
+                        [&](size_t i) { return contains(set, toAdd[i]); });
+
+        FrozenHamt frozen = set.freeze();
+
+        harness.measure("Unsuccessful string lookup (shuffled, frozen)",
+                        notToAdd.size(),
+                        [&](size_t i) { return frozen.find(notToAdd[i]); });
+
+        harness.measure("Successful string lookup (shuffled, frozen)",
+                        toAdd.size(),
+                        [&](size_t i) { return frozen.find(toAdd[i]); });
+
+        // Each batch is looked up on its first key, and the time shared out
+        // over its keys.
+        constexpr size_t BATCH = 64;
+        bool found[BATCH];
+        harness.measure(
+            "Successful string lookup (shuffled, frozen, batched)",
+            toAdd.size(), [&](size_t i) {
+                if (i % BATCH == 0) {
+                    size_t n = std::min(BATCH, toAdd.size() - i);
+                    frozen.find(&toAdd[i], n, found);
+                }
+                return found[i % BATCH];
+            });
+
+        harness.measure("Uniform sample of one string", toAdd.size() / 10,
+                        [&](size_t) {
+                            return set.sample(generator, 1).size();
+                        });
+
+        std::hash<std::string_view> hasher;
+        harness.measure("Approximate rank (2 levels)", notToAdd.size(),
+                        [&](size_t i) {
+                            return set.approximateRank(hasher(notToAdd[i]));
+                        });
+    }
+
+    harness.measure("Unsuccessful string deletion (shuffled)",
+                    notToAdd.size() / 2,
+                    [&](size_t i) { return set.erase(notToAdd[i]); });
+
+    harness.measure("Successful string deletion (shuffled)", toAdd.size() / 2,
+                    [&](size_t i) { return set.erase(toAdd[i]); });
+
+    if constexpr (std::is_same_v<Set, Hamt>) {
+        // The same deletions, in batches, from a fresh copy of the set.
+        Hamt bulk;
+        for (const auto &str : toAdd) {
+            bulk.insert(std::string(str));
+        }
+
+        constexpr size_t BATCH = 1024;
+        size_t half = toAdd.size() / 2;
+        harness.measure(
+            "Successful string deletion (shuffled, batches of 1024)", half,
+            [&](size_t i) {
+                size_t n = std::min(BATCH, half - i);
+                return i % BATCH == 0 ? bulk.eraseBatch(&toAdd[i], n) : 0;
+            });
+
+        // Inserts of new strings alternating with deletions, one at a time
+        // and then in batches, each into a fresh copy of the set.
+        Hamt single;
+        Hamt batched;
+        for (const auto &str : toAdd) {
+            single.insert(std::string(str));
+            batched.insert(std::string(str));
+        }
+
+        size_t changes = std::min(toAdd.size(), notToAdd.size());
+        harness.measure("Mixed insertion and deletion (shuffled)", changes,
+                        [&](size_t i) {
+                            if (i % 2 == 0) {
+                                single.insert(std::string(notToAdd[i]));
+                                return false;
+                            }
+                            return single.erase(toAdd[i]);
+                        });
+
+        harness.measure(
+            "Mixed insertion and deletion (shuffled, batches of 1024)",
+            changes, [&](size_t i) {
+                if (i % BATCH != 0) {
+                    return;
+                }
+                HamtBatch batch;
+                for (size_t j = i; j < std::min(i + BATCH, changes); ++j) {
+                    if (j % 2 == 0) {
+                        batch.insert(notToAdd[j]);
+                    } else {
+                        batch.erase(toAdd[j]);
+                    }
+                }
+                batched.apply(std::move(batch));
+            });
+
+        // Sweeps erasing about half the keys. A sweep can only run once on
+        // a set, so the keys are dealt out into SWEEPS fresh sets, built
+        // untimed, and each sample is one sweep over one of them, its time
+        // shared out over the keys looked at.
+        constexpr size_t SWEEPS = 32;
+        auto evenLength = [](std::string_view str) {
+            return str.size() % 2 == 0;
+        };
+        for (unsigned threads : {1, 4}) {
+            std::vector<Hamt> sets(SWEEPS);
+            for (size_t i = 0; i < toAdd.size(); ++i) {
+                sets[i % SWEEPS].insert(std::string(toAdd[i]));
+            }
+
+            std::vector<double> samples;
+            double totalNs = 0;
+            for (auto &set : sets) {
+                size_t n = set.size();
+                auto start = std::chrono::steady_clock::now();
+                set.eraseIf(evenLength, threads);
+                auto end = std::chrono::steady_clock::now();
+                double ns = nanoseconds(end - start).count();
+                totalNs += ns;
+                samples.push_back(ns / n);
+            }
+
+            Measurement m;
+            m.operations = toAdd.size();
+            m.totalSeconds = totalNs / 1e9;
+            m.meanNs = totalNs / toAdd.size();
+            m.p50Ns = percentile(samples, 0.5);
+            m.p99Ns = percentile(samples, 0.99);
+            m.p999Ns = percentile(samples, 0.999);
+            harness.record("String deletion by predicate (" +
+                               std::to_string(threads) + " threads)",
+                           m);
+        }
+    }
 }
 
-int main(void) {
-    std::cout << "RANDOM STRING BENCHMARKS:\n\n";
+int main(int argc, char **argv) {
+    Harness harness("RANDOM STRING BENCHMARKS", argc, argv);
+    const Keys keys = generateKeys();
 
-    std::cout << "Testing HAMT:\n\n";
-    benchmark<Hamt>();
+    for (int trial = 0; trial < harness.trials(); ++trial) {
+        std::mt19937_64 generator(BENCH_SEED + trial);
 
-    std::cout << "\n\nTesting std::unordered_set:\n\n";
+        harness.group("HAMT");
+        benchmark<Hamt>(harness, keys, generator);
+
+        harness.group("std::unordered_set");
+        benchmark<std::unordered_set<std::string>>(harness, keys, generator);
+    }
 
-    benchmark<std::unordered_set<std::string>>();
+    harness.report();
 
     return 0;
 }
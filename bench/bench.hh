@@ -1,15 +1,34 @@
 #pragma once
 
+#include <algorithm>
 #include <chrono>
-#include <functional>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <map>
 #include <random>
+#include <string>
+#include <type_traits>
+#include <unordered_set>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
-static auto generator = std::mt19937();
 using seconds = std::chrono::duration<double>;
 using nanoseconds = std::chrono::duration<double, std::ratio<1, 1'000'000'000>>;
 
-std::string random_string() {
+// Every benchmark draws from its own generator with a fixed seed, so two runs
+// of the same binary see the same keys in the same order.
+inline constexpr std::uint64_t BENCH_SEED = 0x5eed;
+
+inline std::string random_string(std::mt19937_64 &generator) {
     int length = generator() % 256;
     std::string str(length, 0);
 
@@ -18,19 +37,371 @@ std::string random_string() {
     return str;
 }
 
-void benchmark(std::string name, int nIterations,
-               std::function<void(void)> op) {
-    auto clock = std::chrono::steady_clock();
-    auto start = clock.now();
-    for (int i = 0; i < nIterations; ++i) {
-        op();
-    }
-    auto end = clock.now();
-    auto diff = (end - start);
-    double total = seconds(diff).count();
-    double perOp = nanoseconds(diff).count() / nIterations;
-
-    std::cout << name << ":\n";
-    std::cout << "    Total time: " << total << " s.\n";
-    std::cout << "    Per operation: " << (unsigned)perOp << " ns.\n";
+// Membership test that works for both Hamt and the standard containers.
+template <typename Set> bool contains(const Set &set, const std::string &str) {
+    return set.find(str);
+}
+
+template <typename T>
+bool contains(const std::unordered_set<T> &set, const std::string &str) {
+    return set.find(str) != set.end();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Hardware counters.
+//
+
+// Hardware events read around each measurement, where the kernel lets us.
+struct HardwareCounts {
+    bool valid = false;
+    std::uint64_t instructions = 0;
+    std::uint64_t cacheMisses = 0;
+    std::uint64_t branchMisses = 0;
+};
+
+// A group of hardware counters for the calling thread, opened with
+// perf_event_open(2).
+//
+// Opening fails on non-Linux systems, in most containers, and when
+// perf_event_paranoid forbids it; in that case every reading is invalid and
+// the rest of the harness carries on without them.
+class PerfCounters {
+  public:
+    PerfCounters() {
+#ifdef __linux__
+        static const std::uint64_t configs[NCOUNTERS] = {
+            PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES,
+            PERF_COUNT_HW_BRANCH_MISSES};
+
+        for (int i = 0; i < NCOUNTERS; ++i) {
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = configs[i];
+            attr.disabled = i == 0;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP;
+
+            fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1,
+                             i == 0 ? -1 : fds[0], 0);
+            if (fds[i] < 0) {
+                close();
+                return;
+            }
+        }
+#endif
+    }
+
+    PerfCounters(const PerfCounters &) = delete;
+
+    ~PerfCounters() { close(); }
+
+    bool available() const { return fds[0] >= 0; }
+
+    void start() {
+#ifdef __linux__
+        if (available()) {
+            ioctl(fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+            ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        }
+#endif
+    }
+
+    HardwareCounts stop() {
+        HardwareCounts result;
+#ifdef __linux__
+        if (!available()) {
+            return result;
+        }
+        ioctl(fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+        // With PERF_FORMAT_GROUP the kernel gives us the number of events
+        // followed by each value, in the order they were opened.
+        std::uint64_t values[1 + NCOUNTERS];
+        if (::read(fds[0], values, sizeof(values)) != sizeof(values)) {
+            return result;
+        }
+        result.valid = true;
+        result.instructions = values[1];
+        result.cacheMisses = values[2];
+        result.branchMisses = values[3];
+#endif
+        return result;
+    }
+
+  private:
+    static constexpr int NCOUNTERS = 3;
+
+    void close() {
+#ifdef __linux__
+        for (int i = 0; i < NCOUNTERS; ++i) {
+            if (fds[i] >= 0) {
+                ::close(fds[i]);
+            }
+            fds[i] = -1;
+        }
+#endif
+    }
+
+    int fds[NCOUNTERS] = {-1, -1, -1};
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// The harness.
+//
+
+// The `p`th quantile of `values`, which get partially reordered.
+inline double percentile(std::vector<double> &values, double p) {
+    if (values.empty()) {
+        return 0;
+    }
+    size_t idx =
+        std::min(values.size() - 1, static_cast<size_t>(p * values.size()));
+    std::nth_element(values.begin(), values.begin() + idx, values.end());
+    return values[idx];
 }
+
+// The result of timing one benchmark for one trial.
+struct Measurement {
+    std::uint64_t operations;
+    double totalSeconds;
+    double meanNs;
+    double p50Ns;
+    double p99Ns;
+    double p999Ns;
+    HardwareCounts hardware;
+};
+
+// Runs and records a suite of benchmarks.
+//
+// Operations are timed in batches of `batchSize` so that reading the clock
+// doesn't dominate a ~100 ns operation; the percentiles are therefore of the
+// per-operation latency averaged over a batch, and understate the very worst
+// single operations. The whole suite is meant to be run `trials()` times;
+// every trial of a benchmark is kept, and the report shows the median trial.
+//
+// Recognized command line flags:
+//   --trials N   Number of times to repeat the suite (default 5).
+//   --batch N    Operations per timed batch (default 32).
+//   --json FILE  Also write every trial of every benchmark to FILE.
+//
+// Any other flags are an error, unless `otherArguments` is given to collect
+// them.
+class Harness {
+  public:
+    Harness(std::string suite, int argc, char **argv,
+            std::vector<std::string> *otherArguments = NULL)
+        : suite(std::move(suite)) {
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (i + 1 < argc && arg == "--trials") {
+                nTrials = std::max(1, std::atoi(argv[++i]));
+            } else if (i + 1 < argc && arg == "--batch") {
+                batchSize = std::max(1, std::atoi(argv[++i]));
+            } else if (i + 1 < argc && arg == "--json") {
+                jsonPath = argv[++i];
+            } else if (otherArguments != NULL) {
+                otherArguments->push_back(arg);
+            } else {
+                std::cerr << "Unrecognized argument: " << arg << "\n";
+                std::exit(1);
+            }
+        }
+
+        if (!perf.available()) {
+            std::cerr << "Hardware counters unavailable; reporting timings "
+                         "only.\n";
+        }
+    }
+
+    Harness(const Harness &) = delete;
+
+    int trials() const { return nTrials; }
+
+    // Start a new group of benchmarks (e.g. one container type). Benchmark
+    // names are qualified by the current group.
+    void group(std::string name) { currentGroup = std::move(name); }
+
+    // Time `nIterations` calls of `op(i)`, for i from 0 up.
+    //
+    // Any result op returns is kept alive so the call can't be optimized
+    // out.
+    template <typename Op>
+    void measure(const std::string &name, std::uint64_t nIterations, Op &&op) {
+        std::vector<double> batches;
+        batches.reserve(nIterations / batchSize + 1);
+
+        perf.start();
+        auto clock = std::chrono::steady_clock();
+        auto start = clock.now();
+        auto batchStart = start;
+
+        for (std::uint64_t i = 0; i < nIterations;) {
+            std::uint64_t end = std::min<std::uint64_t>(i + batchSize,
+                                                        nIterations);
+            std::uint64_t n = end - i;
+            for (; i < end; ++i) {
+                if constexpr (std::is_void_v<decltype(op(i))>) {
+                    op(i);
+                } else {
+                    sink += static_cast<std::uint64_t>(op(i));
+                }
+            }
+            auto batchEnd = clock.now();
+            batches.push_back(nanoseconds(batchEnd - batchStart).count() / n);
+            batchStart = batchEnd;
+        }
+
+        auto end = clock.now();
+        HardwareCounts hardware = perf.stop();
+
+        Measurement m;
+        m.operations = nIterations;
+        m.totalSeconds = seconds(end - start).count();
+        m.meanNs = nIterations == 0
+                       ? 0
+                       : nanoseconds(end - start).count() / nIterations;
+        m.p50Ns = percentile(batches, 0.5);
+        m.p99Ns = percentile(batches, 0.99);
+        m.p999Ns = percentile(batches, 0.999);
+        m.hardware = hardware;
+
+        record(name, m);
+    }
+
+    // Record a measurement taken some other way, e.g. across several
+    // threads.
+    void record(const std::string &name, const Measurement &m) {
+        std::string key = currentGroup + "/" + name;
+        if (results.find(key) == results.end()) {
+            order.push_back(key);
+        }
+        results[key].push_back(m);
+    }
+
+    // Print the median trial of every benchmark, and write the JSON report
+    // if one was asked for.
+    void report() const {
+        std::cout << suite << " (" << nTrials << " trials, batches of "
+                  << batchSize << "):\n";
+
+        // Print each group's benchmarks together, in the order they ran.
+        std::vector<std::string> sorted = order;
+        std::stable_sort(sorted.begin(), sorted.end(),
+                         [this](const std::string &a, const std::string &b) {
+                             return groupIndex(a) < groupIndex(b);
+                         });
+
+        std::string lastGroup;
+        for (const auto &key : sorted) {
+            std::string group = key.substr(0, key.find('/'));
+            if (group != lastGroup) {
+                std::cout << "\n" << group << ":\n\n";
+                lastGroup = group;
+            }
+
+            const Measurement &m = median(results.at(key));
+            std::cout << key.substr(key.find('/') + 1) << ":\n";
+            std::cout << "    Total time: " << m.totalSeconds << " s ("
+                      << m.operations / m.totalSeconds / 1e6
+                      << " Mops/s).\n";
+            std::cout << "    Per operation: " << (unsigned)m.meanNs
+                      << " ns (p50 " << (unsigned)m.p50Ns << ", p99 "
+                      << (unsigned)m.p99Ns << ", p99.9 " << (unsigned)m.p999Ns
+                      << ").\n";
+            if (m.hardware.valid && m.operations != 0) {
+                double n = m.operations;
+                std::cout << "    Per operation: "
+                          << m.hardware.instructions / n << " instructions, "
+                          << m.hardware.cacheMisses / n << " cache misses, "
+                          << m.hardware.branchMisses / n
+                          << " branch misses.\n";
+            }
+        }
+
+        if (!jsonPath.empty()) {
+            writeJson();
+        }
+    }
+
+  private:
+    // The position of a benchmark's group among the groups, in the order
+    // they first ran.
+    size_t groupIndex(const std::string &key) const {
+        std::string group = key.substr(0, key.find('/'));
+        size_t idx = 0;
+        std::string last;
+        for (const auto &other : order) {
+            std::string otherGroup = other.substr(0, other.find('/'));
+            if (otherGroup == group) {
+                return idx;
+            }
+            idx += otherGroup != last;
+            last = otherGroup;
+        }
+        return idx;
+    }
+
+    static const Measurement &median(const std::vector<Measurement> &trials) {
+        std::vector<const Measurement *> sorted;
+        for (const auto &m : trials) {
+            sorted.push_back(&m);
+        }
+        std::sort(sorted.begin(), sorted.end(),
+                  [](const Measurement *a, const Measurement *b) {
+                      return a->meanNs < b->meanNs;
+                  });
+        return *sorted[sorted.size() / 2];
+    }
+
+    void writeJson() const {
+        std::ofstream out(jsonPath);
+        out << "{\n  \"suite\": \"" << suite << "\",\n"
+            << "  \"batch\": " << batchSize << ",\n"
+            << "  \"benchmarks\": {";
+
+        bool firstKey = true;
+        for (const auto &key : order) {
+            out << (firstKey ? "\n" : ",\n") << "    \"" << key << "\": [";
+            firstKey = false;
+
+            bool firstTrial = true;
+            for (const auto &m : results.at(key)) {
+                out << (firstTrial ? "\n" : ",\n") << "      {"
+                    << "\"operations\": " << m.operations
+                    << ", \"total_s\": " << m.totalSeconds
+                    << ", \"mean_ns\": " << m.meanNs
+                    << ", \"p50_ns\": " << m.p50Ns
+                    << ", \"p99_ns\": " << m.p99Ns
+                    << ", \"p999_ns\": " << m.p999Ns;
+                if (m.hardware.valid) {
+                    out << ", \"instructions\": " << m.hardware.instructions
+                        << ", \"cache_misses\": " << m.hardware.cacheMisses
+                        << ", \"branch_misses\": " << m.hardware.branchMisses;
+                }
+                out << "}";
+                firstTrial = false;
+            }
+            out << "\n    ]";
+        }
+        out << "\n  }\n}\n";
+    }
+
+    std::string suite;
+    std::string jsonPath;
+    std::string currentGroup;
+    int nTrials = 5;
+    int batchSize = 32;
+
+    PerfCounters perf;
+
+    // Benchmark names in the order they were first run, and every trial of
+    // each.
+    std::vector<std::string> order;
+    std::map<std::string, std::vector<Measurement>> results;
+
+    // Where the results of measured operations go to be ignored.
+    volatile std::uint64_t sink = 0;
+};
@@ -0,0 +1,71 @@
+#include <cstdio>
+
+#include "HAMT.hh"
+#include "allocations.hh"
+#include "bench.hh"
+
+// Repeatedly replace half of the keys in a set with new ones, and check that
+// the trie's depth and memory use stay put.
+int main(int argc, char **argv) {
+    size_t nKeys = 100000;
+    int rounds = 20;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (i + 1 < argc && arg == "--keys") {
+            nKeys = std::stoull(argv[++i]);
+        } else if (i + 1 < argc && arg == "--rounds") {
+            rounds = std::stoi(argv[++i]);
+        } else {
+            std::cerr << "Unrecognized argument: " << arg << "\n";
+            return 1;
+        }
+    }
+
+    // Generate every key up front, so that only the trie's own allocations
+    // are counted.
+    std::mt19937_64 generator(BENCH_SEED);
+    std::vector<std::string> keys;
+    for (size_t i = 0; i < nKeys + rounds * (nKeys / 2); ++i) {
+        keys.push_back(random_string(generator));
+    }
+    std::vector<const std::string *> live;
+    for (size_t i = 0; i < nKeys; ++i) {
+        live.push_back(&keys[i]);
+    }
+    size_t nextKey = nKeys;
+
+    auto before = allocationCounts;
+    Hamt hamt;
+    for (const auto *key : live) {
+        hamt.insert(std::string(*key));
+    }
+
+    std::printf("CHURN BENCHMARK:\n\n");
+    std::printf("%d rounds of replacing half of %zu keys.\n\n", rounds,
+                nKeys);
+    std::printf("%6s %9s %9s %13s %11s %10s %10s\n", "round", "leaves",
+                "nodes", "single-child", "mean depth", "max depth",
+                "bytes/key");
+
+    for (int round = 0; round <= rounds; ++round) {
+        if (round != 0) {
+            std::shuffle(live.begin(), live.end(), generator);
+            for (size_t i = 0; i < live.size() / 2; ++i) {
+                hamt.erase(*live[i]);
+                live[i] = &keys[nextKey++];
+                hamt.insert(std::string(*live[i]));
+            }
+        }
+
+        HamtShape shape = hamt.shape();
+        double bytes = allocationCounts.liveBytes - before.liveBytes;
+        std::printf("%6d %9llu %9llu %13llu %11.3f %10llu %10.1f\n", round,
+                    (unsigned long long)shape.leaves,
+                    (unsigned long long)shape.nodes,
+                    (unsigned long long)shape.singleChildNodes,
+                    (double)shape.totalDepth / shape.leaves,
+                    (unsigned long long)shape.maxDepth, bytes / shape.leaves);
+    }
+
+    return 0;
+}
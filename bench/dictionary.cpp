@@ -1,4 +1,5 @@
 #include <fstream>
+#include <unordered_map>
 #include <unordered_set>
 
 #include "HAMT.hh"
@@ -13,54 +14,116 @@ std::vector<std::string> readDictionary() {
         result.push_back(std::move(word));
     }
 
-    std::random_shuffle(result.begin(), result.end());
+    std::mt19937_64 generator(BENCH_SEED);
+    std::shuffle(result.begin(), result.end(), generator);
 
     return result;
 }
 
-template <typename Set> void benchmark(const std::vector<std::string> &dict) {
+template <typename Set>
+void benchmark(Harness &harness, const std::vector<std::string> &dict,
+               std::mt19937_64 &generator) {
     Set set;
 
     auto dictCopy = dict;
-    auto iter = dictCopy.begin();
-
-    benchmark("Word insertion", dictCopy.size(), [&]() -> void {
-        set.insert(std::move(*iter));
-        iter++;
-    });
+    harness.measure("Word insertion", dictCopy.size(),
+                    [&](size_t i) { set.insert(std::move(dictCopy[i])); });
 
     dictCopy = dict;
-    iter = dictCopy.begin();
-    benchmark("Word lookup", dictCopy.size(), [&]() -> void {
-        set.find(*iter);
-        iter++;
-    });
-
-    std::random_shuffle(dictCopy.begin(), dictCopy.end());
-    iter = dictCopy.begin();
-    benchmark("Word lookup (shuffled)", dictCopy.size(), [&]() -> void {
-        set.find(*iter);
-        iter++;
-    });
-
-    std::random_shuffle(dictCopy.begin(), dictCopy.end());
-    iter = dictCopy.begin();
-    benchmark("Word deletion", dictCopy.size(), [&]() -> void {
-        set.erase(*iter);
-        iter++;
-    });
+    harness.measure("Word lookup", dictCopy.size(),
+                    [&](size_t i) { return contains(set, dictCopy[i]); });
+
+    std::shuffle(dictCopy.begin(), dictCopy.end(), generator);
+    harness.measure("Word lookup (shuffled)", dictCopy.size(),
+                    [&](size_t i) { return contains(set, dictCopy[i]); });
+
+    std::shuffle(dictCopy.begin(), dictCopy.end(), generator);
+    harness.measure("Word deletion", dictCopy.size(),
+                    [&](size_t i) { return set.erase(dictCopy[i]); });
+}
+
+// Counting operations that work for both CountingHamt and std::unordered_map.
+using CountMap = std::unordered_map<std::string, std::uint64_t>;
+
+std::uint64_t addCount(CountingHamt &counts, const std::string &word) {
+    return counts.add(word);
+}
+
+std::uint64_t addCount(CountMap &counts, const std::string &word) {
+    return ++counts[word];
 }
 
-int main(void) {
-    std::cout << "ENGLISH DICTIONARY BENCHMARKS:\n\n";
+std::uint64_t getCount(const CountingHamt &counts, const std::string &word) {
+    return counts.count(word);
+}
+
+std::uint64_t getCount(const CountMap &counts, const std::string &word) {
+    auto it = counts.find(word);
+    return it == counts.end() ? 0 : it->second;
+}
+
+std::uint64_t removeCount(CountingHamt &counts, const std::string &word) {
+    return counts.remove(word);
+}
+
+std::uint64_t removeCount(CountMap &counts, const std::string &word) {
+    auto it = counts.find(word);
+    if (it == counts.end()) {
+        return 0;
+    } else if (it->second > 1) {
+        return --it->second;
+    }
+    counts.erase(it);
+    return 0;
+}
+
+// Count a stream of tokens drawn from the dictionary, each word turning up
+// four times on average, then look up and take away the counts.
+template <typename Counts>
+void countingBenchmark(Harness &harness, const std::vector<std::string> &dict,
+                       std::mt19937_64 &generator) {
+    Counts counts;
+
+    std::vector<std::string> tokens(4 * dict.size());
+    for (auto &token : tokens) {
+        token = dict[generator() % dict.size()];
+    }
+
+    harness.measure("Token counting", tokens.size(),
+                    [&](size_t i) { return addCount(counts, tokens[i]); });
+
+    auto dictCopy = dict;
+    std::shuffle(dictCopy.begin(), dictCopy.end(), generator);
+    harness.measure("Count lookup (shuffled)", dictCopy.size(),
+                    [&](size_t i) { return getCount(counts, dictCopy[i]); });
+
+    std::shuffle(tokens.begin(), tokens.end(), generator);
+    harness.measure("Token removal", tokens.size(),
+                    [&](size_t i) { return removeCount(counts, tokens[i]); });
+}
+
+int main(int argc, char **argv) {
+    Harness harness("ENGLISH DICTIONARY BENCHMARKS", argc, argv);
 
     auto dict = readDictionary();
 
-    std::cout << "Testing HAMT:\n\n";
-    benchmark<Hamt>(dict);
+    for (int trial = 0; trial < harness.trials(); ++trial) {
+        std::mt19937_64 generator(BENCH_SEED + trial);
+
+        harness.group("HAMT");
+        benchmark<Hamt>(harness, dict, generator);
+
+        harness.group("std::unordered_set");
+        benchmark<std::unordered_set<std::string>>(harness, dict, generator);
+
+        harness.group("CountingHamt");
+        countingBenchmark<CountingHamt>(harness, dict, generator);
+
+        harness.group("std::unordered_map");
+        countingBenchmark<CountMap>(harness, dict, generator);
+    }
 
-    std::cout << "\n\nTesting std::unordered_set:\n\n";
-    benchmark<std::unordered_set<std::string>>(dict);
+    harness.report();
 
     return 0;
 }
@@ -0,0 +1,151 @@
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <unordered_set>
+
+#include "HAMT.hh"
+#include "allocations.hh"
+#include "bench.hh"
+
+// A way of generating keys of some realistic length.
+struct KeyDistribution {
+    std::string name;
+    std::function<std::vector<std::string>(size_t n)> generate;
+};
+
+std::string printable_string(std::mt19937_64 &generator, size_t length) {
+    std::string str(length, 0);
+    std::generate_n(str.begin(), length, [&]() {
+        return static_cast<char>(generator() % (126 - 32) + 32);
+    });
+    return str;
+}
+
+// `n` distinct keys with lengths drawn uniformly from [minLength, maxLength].
+std::vector<std::string> uniqueKeys(size_t n, size_t minLength,
+                                    size_t maxLength) {
+    std::mt19937_64 generator(BENCH_SEED);
+    std::unordered_set<std::string> seen;
+    std::vector<std::string> result;
+
+    while (result.size() < n) {
+        size_t length = minLength + generator() % (maxLength - minLength + 1);
+        auto str = printable_string(generator, length);
+        if (seen.insert(str).second) {
+            result.push_back(std::move(str));
+        }
+    }
+
+    return result;
+}
+
+std::vector<std::string> dictionaryKeys(size_t n) {
+    std::ifstream dict("/usr/share/dict/american-english");
+    std::string word;
+    std::vector<std::string> result;
+
+    while (result.size() < n && getline(dict, word)) {
+        result.push_back(std::move(word));
+    }
+
+    return result;
+}
+
+// Build a set of `keys`, then erase 90% of them, and print what that cost.
+//
+// Runs in a forked child, so that peak RSS is that of this configuration
+// alone (plus the keys themselves, which the child inherits).
+template <typename Set>
+void measure(const std::string &container, const std::string &distribution,
+             const std::vector<std::string> &keys) {
+    std::fflush(stdout);
+    pid_t pid = fork();
+    if (pid != 0) {
+        int status;
+        waitpid(pid, &status, 0);
+        return;
+    }
+
+    size_t keyBytes = 0;
+    for (const auto &key : keys) {
+        keyBytes += key.size();
+    }
+    double n = keys.size();
+
+    auto before = allocationCounts;
+    resetPeakLiveBytes();
+
+    auto set = std::make_unique<Set>();
+    for (const auto &key : keys) {
+        set->insert(std::string(key));
+    }
+
+    auto built = allocationCounts;
+    double liveBytes = built.liveBytes - before.liveBytes;
+    double peakBytes = built.peakLiveBytes - before.liveBytes;
+
+    size_t nErased = keys.size() - keys.size() / 10;
+    for (size_t i = 0; i < nErased; ++i) {
+        set->erase(keys[i]);
+    }
+
+    auto erased = allocationCounts;
+    double remaining = keys.size() - nErased;
+    double erasedBytes = erased.liveBytes - before.liveBytes;
+
+    std::printf("%-20s %-10s %9zu %10.1f %10.1f %8.2f %10.1f %12.1f "
+                "%10.1f\n",
+                container.c_str(), distribution.c_str(), keys.size(),
+                liveBytes / n, (liveBytes - keyBytes) / n,
+                (built.allocations - before.allocations) / n, peakBytes / n,
+                remaining == 0 ? 0 : erasedBytes / remaining,
+                peakRss() / (1024.0 * 1024.0));
+    std::fflush(stdout);
+    _exit(0);
+}
+
+int main(int argc, char **argv) {
+    size_t maxKeys = 1000000;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (i + 1 < argc && arg == "--max-keys") {
+            maxKeys = std::stoull(argv[++i]);
+        } else {
+            std::cerr << "Unrecognized argument: " << arg << "\n";
+            return 1;
+        }
+    }
+
+    std::vector<KeyDistribution> distributions = {
+        {"short", [](size_t n) { return uniqueKeys(n, 4, 16); }},
+        {"medium", [](size_t n) { return uniqueKeys(n, 16, 48); }},
+        {"long", [](size_t n) { return uniqueKeys(n, 0, 255); }},
+        {"dictionary", dictionaryKeys},
+    };
+
+    std::cout << "MEMORY BENCHMARKS:\n\n";
+    std::cout << "Bytes are heap bytes per key (usable size, excluding "
+                 "allocator headers).\n"
+                 "Overhead excludes the key bytes themselves. After erase "
+                 "is per remaining key,\nwith 90% of keys erased.\n\n";
+    std::printf("%-20s %-10s %9s %10s %10s %8s %10s %12s %10s\n",
+                "container", "keys", "count", "bytes/key", "overhead",
+                "allocs", "peak/key", "after erase", "rss (MiB)");
+
+    for (const auto &distribution : distributions) {
+        for (size_t count = 10000; count <= maxKeys; count *= 10) {
+            auto keys = distribution.generate(count);
+            if (keys.size() < count) {
+                break;
+            }
+
+            measure<Hamt>("HAMT", distribution.name, keys);
+            measure<std::unordered_set<std::string>>(
+                "std::unordered_set", distribution.name, keys);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,414 @@
+// A YCSB-style workload driver.
+//
+// The set starts with `records` keys. Keys live in a sliding window of key
+// indices: inserts add the next new key at the top of the window, and erases
+// remove the oldest key at the bottom, so a workload with equal insert and
+// erase ratios churns through keys at a fixed size. Reads pick a key from the
+// window by a uniform, Zipfian (scrambled, as in YCSB, so the hot keys are
+// spread over the trie) or latest (Zipfian over recency) distribution.
+//
+// Every workload is run at each thread count of the sweep, against a HAMT and
+// a std::unordered_set, each guarded by a reader-writer lock.
+
+#include <atomic>
+#include <cmath>
+#include <fstream>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_set>
+
+#include "HAMT.hh"
+#include "bench.hh"
+
+//////////////////////////////////////////////////////////////////////////////
+// Key distributions.
+//
+
+// Draws ranks in [0, n) with P(rank) proportional to 1 / (rank + 1)^theta,
+// using the method of Gray et al., "Quickly Generating Billion-Record
+// Synthetic Databases", as YCSB does.
+class ZipfianGenerator {
+  public:
+    explicit ZipfianGenerator(std::uint64_t n, double theta = 0.99)
+        : n(n), theta(theta) {
+        zetan = zeta(n, theta);
+        alpha = 1.0 / (1.0 - theta);
+        eta = (1 - std::pow(2.0 / n, 1 - theta)) / (1 - zeta(2, theta) / zetan);
+    }
+
+    template <typename Rng> std::uint64_t next(Rng &rng) {
+        double u = std::uniform_real_distribution<double>(0, 1)(rng);
+        double uz = u * zetan;
+        if (uz < 1.0) {
+            return 0;
+        }
+        if (uz < 1.0 + std::pow(0.5, theta)) {
+            return 1;
+        }
+        auto rank = static_cast<std::uint64_t>(
+            n * std::pow(eta * u - eta + 1, alpha));
+        return std::min(rank, n - 1);
+    }
+
+  private:
+    static double zeta(std::uint64_t n, double theta) {
+        double sum = 0;
+        for (std::uint64_t i = 0; i < n; ++i) {
+            sum += 1 / std::pow(i + 1, theta);
+        }
+        return sum;
+    }
+
+    std::uint64_t n;
+    double theta;
+    double zetan;
+    double alpha;
+    double eta;
+};
+
+enum class Distribution { Uniform, Zipfian, Latest };
+
+const char *distributionName(Distribution d) {
+    switch (d) {
+    case Distribution::Uniform:
+        return "uniform";
+    case Distribution::Zipfian:
+        return "zipfian";
+    case Distribution::Latest:
+        return "latest";
+    }
+    return "";
+}
+
+struct Workload {
+    std::string name;
+    double read;
+    double insert;
+    double erase;
+    Distribution distribution;
+};
+
+// The YCSB core workloads that make sense for a set, plus steady-state churn.
+//
+// A set has no values to update, so YCSB's updates become inserts of new
+// keys here.
+const std::vector<Workload> PRESETS = {
+    {"A (update heavy)", 0.5, 0.5, 0, Distribution::Zipfian},
+    {"B (read mostly)", 0.95, 0.05, 0, Distribution::Zipfian},
+    {"C (read only)", 1, 0, 0, Distribution::Zipfian},
+    {"D (read latest)", 0.95, 0.05, 0, Distribution::Latest},
+    {"churn", 0.8, 0.1, 0.1, Distribution::Uniform},
+};
+
+// Generates distinct keys whose lengths follow a given distribution.
+//
+// Each key starts with its index in base 94, so keys never collide; the rest
+// is random printable characters.
+class KeySpace {
+  public:
+    explicit KeySpace(std::vector<size_t> lengths)
+        : lengths(std::move(lengths)) {}
+
+    std::vector<std::string> generate(size_t n) const {
+        std::mt19937_64 generator(BENCH_SEED);
+        std::vector<std::string> result;
+        result.reserve(n);
+
+        for (size_t i = 0; i < n; ++i) {
+            std::string key;
+            for (size_t idx = i; idx != 0 || key.empty(); idx /= 94) {
+                key.push_back(static_cast<char>(33 + idx % 94));
+            }
+            size_t length = lengths[generator() % lengths.size()];
+            while (key.size() < length) {
+                key.push_back(static_cast<char>(32 + generator() % 95));
+            }
+            result.push_back(std::move(key));
+        }
+
+        return result;
+    }
+
+  private:
+    std::vector<size_t> lengths;
+};
+
+// The lengths of the lines of `path`, or of random strings as in `bench` if
+// there's no such file.
+std::vector<size_t> keyLengths(const std::string &path) {
+    std::vector<size_t> lengths;
+    std::ifstream file(path);
+    std::string line;
+    while (getline(file, line)) {
+        lengths.push_back(line.size());
+    }
+
+    if (lengths.empty()) {
+        for (size_t length = 0; length < 256; ++length) {
+            lengths.push_back(length);
+        }
+    }
+    return lengths;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// The driver.
+//
+
+// A set guarded by a reader-writer lock.
+template <typename Set> class LockedSet {
+  public:
+    bool find(const std::string &key) {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        return contains(set, key);
+    }
+
+    void insert(std::string key) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        set.insert(std::move(key));
+    }
+
+    // Call `f` on the set under the write lock, so that it can pick a key
+    // and change the set in one step.
+    template <typename F> void update(F &&f) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        f(set);
+    }
+
+  private:
+    std::shared_mutex mutex;
+    Set set;
+};
+
+enum Op { READ, INSERT, ERASE, NOPS };
+
+const char *OP_NAMES[NOPS] = {"read", "insert", "erase"};
+
+struct Config {
+    size_t records = 100000;
+    size_t operations = 1000000;
+    std::vector<unsigned> threads;
+    std::string keyFile = "/usr/share/dict/american-english";
+    std::vector<Workload> workloads = PRESETS;
+};
+
+template <typename Set>
+void run(Harness &harness, const Config &config, const Workload &workload,
+         unsigned nThreads, const std::vector<std::string> &keys) {
+    LockedSet<Set> set;
+    for (size_t i = 0; i < config.records; ++i) {
+        set.insert(keys[i]);
+    }
+
+    // The live keys are those with indices in [oldest, newest). Both only
+    // change under the write lock, once the key has been inserted or
+    // erased, so an erase never gets ahead of the insert of its key.
+    std::atomic<std::uint64_t> oldest(0);
+    std::atomic<std::uint64_t> newest(config.records);
+    std::atomic<bool> go(false);
+
+    std::vector<std::vector<double>> latencies(nThreads * NOPS);
+    std::vector<std::thread> workers;
+
+    ZipfianGenerator zipfian(config.records);
+
+    for (unsigned t = 0; t < nThreads; ++t) {
+        workers.emplace_back([&, t]() {
+            std::mt19937_64 rng(BENCH_SEED + t);
+            std::uniform_real_distribution<double> coin(0, 1);
+            ZipfianGenerator zipf = zipfian;
+            size_t nOps = config.operations / nThreads;
+            auto *mine = &latencies[t * NOPS];
+            for (int op = 0; op < NOPS; ++op) {
+                mine[op].reserve(nOps);
+            }
+
+            while (!go) {
+            }
+
+            for (size_t i = 0; i < nOps; ++i) {
+                double c = coin(rng);
+                Op op = c < workload.read                     ? READ
+                        : c < workload.read + workload.insert ? INSERT
+                                                              : ERASE;
+
+                std::uint64_t lo = oldest, hi = newest;
+                std::uint64_t idx = lo;
+                if (op == READ && hi > lo) {
+                    std::uint64_t window = hi - lo;
+                    switch (workload.distribution) {
+                    case Distribution::Uniform:
+                        idx = lo + rng() % window;
+                        break;
+                    case Distribution::Zipfian:
+                        // Scramble the rank so hot keys aren't clustered.
+                        idx = lo + (zipf.next(rng) * 0x9e3779b97f4a7c15ULL) %
+                                       window;
+                        break;
+                    case Distribution::Latest:
+                        idx = hi - 1 - std::min(zipf.next(rng), window - 1);
+                        break;
+                    }
+                }
+
+                auto start = std::chrono::steady_clock::now();
+                switch (op) {
+                case READ:
+                    set.find(keys[idx]);
+                    break;
+                case INSERT:
+                    set.update([&](Set &s) {
+                        std::uint64_t next = newest;
+                        if (next < keys.size()) {
+                            s.insert(std::string(keys[next]));
+                            newest = next + 1;
+                        }
+                    });
+                    break;
+                default:
+                    set.update([&](Set &s) {
+                        std::uint64_t next = oldest;
+                        if (next < newest) {
+                            s.erase(keys[next]);
+                            oldest = next + 1;
+                        }
+                    });
+                    break;
+                }
+                auto end = std::chrono::steady_clock::now();
+                mine[op].push_back(nanoseconds(end - start).count());
+            }
+        });
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    go = true;
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    std::string name = workload.name + " " +
+                       distributionName(workload.distribution) + ", " +
+                       std::to_string(nThreads) + " threads";
+
+    auto summarize = [&](std::vector<double> values) {
+        Measurement m;
+        m.operations = values.size();
+        m.totalSeconds = seconds(end - start).count();
+        m.meanNs = 0;
+        for (double v : values) {
+            m.meanNs += v / values.size();
+        }
+        m.p50Ns = percentile(values, 0.5);
+        m.p99Ns = percentile(values, 0.99);
+        m.p999Ns = percentile(values, 0.999);
+        return m;
+    };
+
+    std::vector<double> all;
+    for (int op = 0; op < NOPS; ++op) {
+        std::vector<double> ofOp;
+        for (unsigned t = 0; t < nThreads; ++t) {
+            auto &l = latencies[t * NOPS + op];
+            ofOp.insert(ofOp.end(), l.begin(), l.end());
+        }
+        all.insert(all.end(), ofOp.begin(), ofOp.end());
+        if (!ofOp.empty()) {
+            harness.record(name + ": " + OP_NAMES[op], summarize(ofOp));
+        }
+    }
+
+    // For the overall figure, the mean is the inverse of the throughput.
+    Measurement overall = summarize(all);
+    overall.meanNs = nanoseconds(end - start).count() / all.size();
+    harness.record(name, overall);
+}
+
+Config parseConfig(const std::vector<std::string> &args) {
+    Config config;
+    Workload custom = {"custom", 1, 0, 0, Distribution::Zipfian};
+    bool haveCustom = false;
+
+    for (size_t i = 0; i + 1 < args.size(); i += 2) {
+        const std::string &flag = args[i];
+        const std::string &value = args[i + 1];
+        if (flag == "--records") {
+            config.records = std::stoull(value);
+        } else if (flag == "--operations") {
+            config.operations = std::stoull(value);
+        } else if (flag == "--threads") {
+            config.threads = {static_cast<unsigned>(std::stoul(value))};
+        } else if (flag == "--keys") {
+            config.keyFile = value;
+        } else if (flag == "--read") {
+            custom.read = std::stod(value);
+            haveCustom = true;
+        } else if (flag == "--insert") {
+            custom.insert = std::stod(value);
+            haveCustom = true;
+        } else if (flag == "--erase") {
+            custom.erase = std::stod(value);
+            haveCustom = true;
+        } else if (flag == "--distribution") {
+            custom.distribution = value == "uniform"  ? Distribution::Uniform
+                                  : value == "latest" ? Distribution::Latest
+                                                      : Distribution::Zipfian;
+            haveCustom = true;
+        } else {
+            std::cerr << "Unrecognized argument: " << flag << "\n";
+            std::exit(1);
+        }
+    }
+    if (args.size() % 2 != 0) {
+        std::cerr << "Missing value for " << args.back() << "\n";
+        std::exit(1);
+    }
+
+    if (haveCustom) {
+        double total = custom.read + custom.insert + custom.erase;
+        custom.read /= total;
+        custom.insert /= total;
+        custom.erase /= total;
+        config.workloads = {custom};
+    }
+
+    // By default, sweep powers of two up to the number of hardware threads.
+    if (config.threads.empty()) {
+        unsigned max = std::max(1u, std::thread::hardware_concurrency());
+        for (unsigned t = 1; t < max; t *= 2) {
+            config.threads.push_back(t);
+        }
+        config.threads.push_back(max);
+    }
+
+    return config;
+}
+
+int main(int argc, char **argv) {
+    std::vector<std::string> args;
+    Harness harness("WORKLOAD BENCHMARKS", argc, argv, &args);
+    Config config = parseConfig(args);
+
+    // Enough keys for every operation to be an insert.
+    KeySpace keySpace(keyLengths(config.keyFile));
+    auto keys = keySpace.generate(config.records + config.operations);
+
+    for (int trial = 0; trial < harness.trials(); ++trial) {
+        for (const auto &workload : config.workloads) {
+            for (unsigned nThreads : config.threads) {
+                harness.group("HAMT");
+                run<Hamt>(harness, config, workload, nThreads, keys);
+
+                harness.group("std::unordered_set");
+                run<std::unordered_set<std::string>>(harness, config,
+                                                     workload, nThreads, keys);
+            }
+        }
+    }
+
+    harness.report();
+
+    return 0;
+}
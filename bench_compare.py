@@ -0,0 +1,89 @@
+#! /usr/bin/env python3
+
+"""Compare two sets of benchmark results and flag regressions.
+
+Usage: bench_compare.py OLD NEW [--threshold PERCENT]
+
+OLD and NEW are either JSON files written by a benchmark's `--json` flag or
+directories of them (as written by `bench.py OUTDIR`). A benchmark counts as
+a regression when its median p50 or p99 latency got worse by more than the
+threshold (default 5%), *and* the fastest new trial is slower than the
+slowest old one, so that run-to-run noise alone isn't flagged.
+
+Exits with status 1 if anything regressed.
+"""
+
+import glob
+import json
+import os
+import statistics
+import sys
+
+
+def loadResults(path):
+    """Map "suite/group/benchmark" to its list of trials."""
+    paths = sorted(glob.glob(os.path.join(path, "*.json"))) \
+        if os.path.isdir(path) else [path]
+
+    results = {}
+    for p in paths:
+        with open(p) as f:
+            data = json.load(f)
+        for name, trials in data["benchmarks"].items():
+            results[f"{data['suite']}/{name}"] = trials
+    return results
+
+
+def median(trials, field):
+    return statistics.median(t[field] for t in trials)
+
+
+def compare(old, new, threshold):
+    regressions = 0
+    fields = ["p50_ns", "p99_ns"]
+
+    for name in sorted(old.keys() & new.keys()):
+        o, n = old[name], new[name]
+        noisy = min(t["mean_ns"] for t in n) <= max(t["mean_ns"] for t in o)
+
+        changes = []
+        regressed = False
+        for field in fields:
+            before, after = median(o, field), median(n, field)
+            change = 100 * (after - before) / before if before else 0
+            changes.append(f"{field} {before:.0f} -> {after:.0f} "
+                           f"({change:+.1f}%)")
+            if change > threshold and not noisy:
+                regressed = True
+
+        mark = "REGRESSION" if regressed else "ok"
+        print(f"{mark:10} {name}: {', '.join(changes)}")
+        regressions += regressed
+
+    for name in sorted(old.keys() - new.keys()):
+        print(f"{'missing':10} {name}")
+
+    return regressions
+
+
+def main():
+    args = sys.argv[1:]
+    threshold = 5.0
+    if "--threshold" in args:
+        i = args.index("--threshold")
+        threshold = float(args[i + 1])
+        del args[i:i + 2]
+
+    if len(args) != 2:
+        sys.stderr.write(__doc__)
+        exit(2)
+
+    regressions = compare(loadResults(args[0]), loadResults(args[1]),
+                          threshold)
+    if regressions:
+        print(f"\n{regressions} regression(s) beyond {threshold}%.")
+        exit(1)
+
+
+if __name__ == "__main__":
+    main()
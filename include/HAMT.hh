@@ -1,8 +1,16 @@
+#include <algorithm>
 #include <cassert>
+#include <condition_variable>
 #include <cstdint>
 #include <cstring>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <random>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_set>
 #include <vector>
 
 //////////////////////////////////////////////////////////////////////////////
@@ -31,7 +39,30 @@ static_assert(MAX_IDX <= 64, "2^MAX_IDX - 1 must fit within a 64-bit word");
 class HamtNodeEntry;
 class HamtLeaf;
 class HamtNode;
+class HamtNodePool;
 class Hamt;
+class CountingHamt;
+class FrozenHamt;
+
+// Deletes a HamtNode, unless it lives in an arena, in which case it only
+// destroys it. The memory is reclaimed with the rest of the arena.
+struct HamtNodeDeleter {
+    bool inArena = false;
+
+    void operator()(HamtNode *node) const;
+};
+
+using HamtNodePtr = std::unique_ptr<HamtNode, HamtNodeDeleter>;
+
+// Frees a HamtLeaf, unless it lives in a HamtLeafSlab, in which case its
+// memory is reclaimed with the rest of the slab.
+struct HamtLeafDeleter {
+    bool inSlab = false;
+
+    void operator()(HamtLeaf *leaf) const;
+};
+
+using HamtLeafPtr = std::unique_ptr<HamtLeaf, HamtLeafDeleter>;
 
 // An entry in one of the tables at each node of the trie.
 //
@@ -41,13 +72,15 @@ class Hamt;
 //  - NULL, indicating there is nothing at this entry.
 //
 // Each entry fits in a single pointer; the first two cases are distinguished
-// using the pointer's low bit.
+// using the pointer's low bit. The next bit marks nodes that live in an arena
+// (see HamtNodeArena), or leaves that live in a slab (see HamtLeafSlab),
+// rather than in their own allocation.
 //
 class HamtNodeEntry {
   public:
-    explicit HamtNodeEntry(std::unique_ptr<HamtNode> node);
+    explicit HamtNodeEntry(HamtNodePtr node);
 
-    explicit HamtNodeEntry(std::unique_ptr<HamtLeaf> leaf);
+    explicit HamtNodeEntry(HamtLeafPtr leaf);
 
     // Initialize the pointer to NULL.
     HamtNodeEntry();
@@ -71,40 +104,63 @@ class HamtNodeEntry {
     // Test whether this entry is NULL.
     bool isNull() const;
 
+    // The number of leaves at or under this entry.
+    std::uint64_t size() const;
+
     // Get a pointer to the child node.
     //
     // isLeaf() and isNull() must both be false.
-    std::unique_ptr<HamtNode> takeChild();
+    HamtNodePtr takeChild();
     HamtNode &getChild();
     const HamtNode &getChild() const;
 
     // Get a pointer to the leaf.
     //
     // isLeaf() must be true.
-    std::unique_ptr<HamtLeaf> takeLeaf();
+    HamtLeafPtr takeLeaf();
     HamtLeaf &getLeaf();
     const HamtLeaf &getLeaf() const;
 
   private:
-    // 0 for NULL. The low bit is set if this points to a leaf.
-    // Otherwise, it points to a node.
+    // 0 for NULL. The low bit is set if this points to a leaf, and then the
+    // second bit is set if the leaf is in a slab. Otherwise, it points to a
+    // node, and the second bit is set if that node is in an arena.
     uintptr_t ptr;
 };
 
 // A leaf node.
 //
-// Stores a vector of keys, each of which must have the same hash.
-// Additionally stores a shifted hash to avoid recomputing the hash on inserts;
-// see below.
+// Stores a single key. Additionally stores a shifted hash to avoid recomputing
+// the hash on inserts; see below.
+//
+// The key's bytes follow the leaf in the same allocation, so the leaf has
+// variable size, like a HamtNode, and should *never* be allocated with `new`.
 class HamtLeaf {
   public:
-    // Construct a new HamtLeaf with the given key.
-    explicit HamtLeaf(std::string data, std::uint64_t hash);
+    // Construct a new HamtLeaf with the given hash, for a key of `length`
+    // bytes, which the trie then copies to `offset` bytes past the leaf.
+    HamtLeaf(std::uint64_t hash, std::uint32_t length, std::uint32_t offset);
 
     // The key stored at this node.
-    std::string data;
+    std::string_view key() const;
 
     std::uint64_t hash;
+
+    // The length of the key, and where its bytes start, counting from the
+    // start of the leaf. That's past the end of whichever type of leaf this
+    // is.
+    std::uint32_t length;
+    std::uint32_t offset;
+};
+
+// A leaf of a CountingHamt, which also stores the number of times its key has
+// been added. Its key's bytes follow the count.
+class HamtCountedLeaf : public HamtLeaf {
+  public:
+    HamtCountedLeaf(std::uint64_t hash, std::uint32_t length,
+                    std::uint32_t offset);
+
+    std::uint64_t count;
 };
 
 // A node containing a sub-table.
@@ -125,13 +181,24 @@ class HamtNode {
 
     // Create a new HamtNode based on the given node, but with the entry at
     // the given hash removed.
-    HamtNode(std::unique_ptr<HamtNode> node, uint64_t hash);
+    HamtNode(HamtNodePtr node, uint64_t hash);
 
     // Create a new HamtNode based on the given node, but with the given entry
     // and hash added (at the appropriate index).
-    HamtNode(std::unique_ptr<HamtNode> node, HamtNodeEntry entry,
+    HamtNode(HamtNodePtr node, HamtNodeEntry entry,
              uint64_t hash);
 
+    // Create a new HamtNode based on the given node, but with every NULL
+    // entry removed. At least one entry must be non-NULL.
+    explicit HamtNode(HamtNodePtr node);
+
+    // Create a new HamtNode with the given bits set in its map, and with
+    // `size` leaves under its children, which are copied bit for bit from
+    // `entries`, one per bit, sorted from high to low bits. The caller sees
+    // to it that only the new node goes on to free them.
+    HamtNode(uint64_t map, uint64_t size,
+             const HamtNodeEntry *const *entries);
+
     // Efficiently get the number of children of this node.
     int numberOfChildren() const;
 
@@ -156,7 +223,15 @@ class HamtNode {
 
     void unmarkHash(uint64_t hash);
 
+    // Make this node empty without freeing its children, once they've been
+    // copied elsewhere.
+    void forgetChildren();
+
+    // The number of bytes allocated for a node with `nChildren` children.
+    static size_t allocationSize(int nChildren);
+
     void *operator new(size_t size, int nChildren);
+    void *operator new(size_t size, HamtNodePool &pool, int nChildren);
     void operator delete(void *p);
 
     ~HamtNode();
@@ -176,6 +251,9 @@ class HamtNode {
     // to get 2, and don't subtract 1, since the bit is currently unset.
     uint64_t map;
 
+    // The number of leaves in the subtree under this node.
+    uint64_t size;
+
     // Sorted from high to low bits. So if the first six bits of a key are the
     // *highest* of the keys stored at this node, it will be *first* in this
     // vector.
@@ -185,6 +263,136 @@ class HamtNode {
     HamtNodeEntry children[1];
 };
 
+// A cache of memory from freed HamtNodes, by number of children, to be reused
+// for new nodes.
+//
+// Every block is allocated just as `new (nChildren) HamtNode` would allocate
+// it, so nodes from the pool can be deleted normally, and the pool can take
+// memory from nodes that didn't come from it.
+class HamtNodePool {
+  public:
+    HamtNodePool() = default;
+    HamtNodePool(const HamtNodePool &) = delete;
+    HamtNodePool(HamtNodePool &&other);
+    HamtNodePool &operator=(HamtNodePool &&other);
+
+    // Free all memory in the pool.
+    ~HamtNodePool();
+    void clear();
+
+    // Get memory for a node with `nChildren` children, from the pool if it
+    // has any.
+    void *allocate(int nChildren);
+
+    // Keep the memory of a destroyed node with `nChildren` children.
+    void release(void *p, int nChildren);
+
+    // Allocate `count` more blocks for nodes with `nChildren` children.
+    void reserve(int nChildren, size_t count);
+
+    // The number of free blocks for nodes with `nChildren` children.
+    size_t available(int nChildren) const;
+
+  private:
+    // Singly-linked lists of free blocks, threaded through their first word,
+    // indexed by number of children minus one.
+    void *freeLists[MAX_IDX] = {};
+};
+
+// Chunks of contiguous memory that compaction relocates nodes into.
+//
+// Nodes in an arena are never freed individually: deleting one only destroys
+// it, and its memory is reclaimed when the whole arena is freed.
+class HamtNodeArena {
+  public:
+    HamtNodeArena() = default;
+    HamtNodeArena(const HamtNodeArena &) = delete;
+    HamtNodeArena(HamtNodeArena &&other);
+    HamtNodeArena &operator=(HamtNodeArena &&other);
+
+    // Free every chunk. No node may still be in use.
+    ~HamtNodeArena();
+    void clear();
+
+    // Make sure the next `bytes` of allocations are contiguous.
+    void reserve(size_t bytes);
+
+    // Get memory for a node with `nChildren` children, directly after the
+    // last node allocated if there's room in the current chunk.
+    void *allocate(int nChildren);
+
+    // The total size of the arena's chunks.
+    size_t capacity() const;
+
+  private:
+    struct Chunk {
+        char *memory;
+        size_t size;
+    };
+
+    void addChunk(size_t bytes);
+
+    std::vector<Chunk> chunks;
+
+    // Bytes used in the last chunk.
+    size_t used = 0;
+};
+
+// Memory set aside for leaves and their keys by reserve(), handed out in
+// order.
+//
+// Leaves in a slab are never freed individually: deleting one only destroys
+// it, and its memory is reclaimed when the whole slab is freed or rewound.
+class HamtLeafSlab {
+  public:
+    HamtLeafSlab() = default;
+    HamtLeafSlab(const HamtLeafSlab &) = delete;
+    HamtLeafSlab(HamtLeafSlab &&other);
+    HamtLeafSlab &operator=(HamtLeafSlab &&other);
+
+    // Free every block. No leaf in the slab may still be in use.
+    ~HamtLeafSlab();
+    void clear();
+
+    // Make every block available again, once none of its leaves are in use.
+    void rewind();
+
+    // Make sure there are at least `bytes` more bytes for leaves.
+    void reserve(size_t bytes);
+
+    // Get `bytes` bytes for a leaf, or NULL if the slab has no room.
+    void *allocate(size_t bytes);
+
+  private:
+    struct Block {
+        char *memory;
+        size_t size;
+    };
+
+    std::vector<Block> blocks;
+
+    // The block being handed out, and how many of its bytes have been.
+    size_t current = 0;
+    size_t used = 0;
+};
+
+// Statistics on the shape of a trie.
+struct HamtShape {
+    std::uint64_t leaves = 0;
+    std::uint64_t nodes = 0;
+
+    // Nodes with just one child. These only occur above a node where two or
+    // more keys' hashes diverge.
+    std::uint64_t singleChildNodes = 0;
+
+    // The depth of the deepest leaf, counting leaves in the top-level node as
+    // depth 0.
+    std::uint64_t maxDepth = 0;
+
+    // The sum of every leaf's depth.
+    std::uint64_t totalDepth = 0;
+};
+
 // The distinguished top-level node.
 //
 // Just a table of MAX_IDX HamtNodeEntrys. The top node is likely to fill up
@@ -192,38 +400,672 @@ class HamtNode {
 // fiddling with the bitmap.
 class TopLevelHamtNode {
   public:
-    void insert(uint64_t hash, std::string &&str);
+    // If `counted` is set, the trie's leaves are HamtCountedLeafs.
+    explicit TopLevelHamtNode(bool counted = false);
+    TopLevelHamtNode(TopLevelHamtNode &&other);
+    TopLevelHamtNode &operator=(TopLevelHamtNode &&other);
+
+    // Free the whole trie without recursing, so that deep chains of
+    // colliding keys can't overflow the stack.
+    ~TopLevelHamtNode();
+
+    // Remove every key. If `keepMemory` is set, the memory of the nodes is
+    // kept in the pool for new nodes.
+    void clear(bool keepMemory);
+
+    // Relocate the nodes in some of the table's entries, resuming where the
+    // last call stopped, until at least `budget` nodes have been moved. Return
+    // whether that completed a pass over the whole trie.
+    bool compact(size_t budget);
+
+    // Return the leaf holding `str`, whether or not it was already there. A
+    // new counted leaf starts with a count of 0.
+    HamtLeaf &insert(uint64_t hash, std::string_view str);
+
+    // The number of keys in the trie.
+    size_t size() const;
+
+    // The key at position `rank` in the trie's order, which must be less than
+    // size(). The trie orders keys by their hashes' index at each level in
+    // turn, from the lowest bits up.
+    const HamtLeaf &nth(std::uint64_t rank) const;
+
+    // Approximately how many keys come before `hash` in the trie's order,
+    // looking at no more than `levels` levels of the trie, and summing the
+    // sizes of up to MAX_IDX entries at each.
+    size_t approximateRank(std::uint64_t hash, unsigned levels) const;
+
+    // Set aside memory for the trie to grow to `n` keys, averaging `length`
+    // bytes each.
+    void reserve(size_t n, size_t length);
+
+    // The memory kept for new nodes.
+    const HamtNodePool &nodePool() const;
+
+    // Return the leaf holding `str`, or NULL if there isn't one.
+    const HamtLeaf *find(uint64_t hash, std::string_view str) const;
+
+    // Take `delta` from the count of the leaf holding `str`, and erase the
+    // leaf if that leaves nothing. Uncounted leaves are always erased. Return
+    // whether there was a leaf, and if `left` isn't NULL, set it to the count
+    // that's left.
+    bool erase(uint64_t hash, std::string_view str,
+               std::uint64_t delta = UINT64_MAX, std::uint64_t *left = NULL);
+
+    // A key to erase with eraseBatch(), and its hash.
+    struct BatchKey {
+        std::string_view key;
+        std::uint64_t hash;
+    };
+
+    // Erase every key `pred` returns true for, dividing the table among
+    // `threads` threads. Return how many were erased.
+    size_t eraseIf(const std::function<bool(std::string_view)> &pred,
+                   unsigned threads);
+
+    // Erase every key in `batch`, which gets reordered, dividing the table
+    // among `threads` threads. Return how many were erased.
+    size_t eraseBatch(std::vector<BatchKey> &batch, unsigned threads);
 
-    bool find(uint64_t hash, const std::string &str) const;
+    // A change for apply(): insert or erase a key, given its hash.
+    struct BatchChange {
+        std::string_view key;
+        std::uint64_t hash;
+        bool insert;
 
-    bool erase(uint64_t hash, const std::string &str);
+        // A leaf that already holds the key, when it moves down the trie.
+        HamtNodeEntry *leaf;
+    };
+
+    // Make every change in `batch`, which gets reordered, all at once, the
+    // last change to a key winning. If an allocation fails, throw with the
+    // trie left untouched.
+    void apply(std::vector<BatchChange> &batch);
+
+    HamtShape shape() const;
+
+    // Copy the trie into the read-only layout of a FrozenHamt.
+    FrozenHamt freeze() const;
 
   private:
+    // If `entry`, at the given level, has been left with a single leaf child,
+    // move that leaf up to `target`, at `targetLevel`, freeing the nodes in
+    // between. `targetHash` is the hash at `targetLevel` of a key that shared
+    // the path to `entry`.
+    void collapse(HamtNodeEntry *entry, unsigned level, HamtNodeEntry *target,
+                  unsigned targetLevel, uint64_t targetHash);
+
+    // Add `delta` to the sizes of the first `depth` nodes on the path to
+    // `str`, whose hash is `hash`. As many of them as fit are in `path`.
+    void resizePath(HamtNode **path, size_t depth, uint64_t hash,
+                    std::string_view str, std::int64_t delta);
+
+    // Make a leaf for a new key, from the slab if it has room.
+    HamtLeafPtr newLeaf(uint64_t hash, std::string_view str);
+
+    // Account for a leaf that's leaving the trie.
+    void discardKey(const HamtLeaf &leaf);
+
+    // Remove the entry at the given hash from the node at `entry`, or clear
+    // `entry` if it's a leaf.
+    void deleteFromNode(HamtNodeEntry *entry, uint64_t hash);
+
+    // Free every entry in the table, putting node memory into `pool` if it's
+    // non-NULL.
+    void destroy(HamtNodePool *pool);
+
+    // Erases keys from the subtree under one entry of the table, given the
+    // entry's index. Erased leaves are taken out of the trie and added to
+    // `doomed`, and new nodes come from `pool` if it's non-NULL.
+    using Sweep = std::function<void(
+        unsigned slot, HamtNodePool *pool,
+        std::vector<HamtLeafPtr> &doomed)>;
+
+    // Run `sweep` over every entry of the table, on `threads` threads,
+    // discarding the keys it erases. Return how many there were.
+    size_t sweepTable(unsigned threads, const Sweep &sweep);
+
+    // Move the node at `entry`, and everything beneath it, into `arena` in
+    // depth-first order. Return the number of nodes moved.
+    size_t relocate(HamtNodeEntry *entry, HamtNodeArena &arena);
+
+    // What apply() has built and what it will free, while it can still back
+    // out.
+    struct Transaction;
+
+    // Work out the changes to the subtree at the table entry at index
+    // `slot`, from the changes in [begin, end), whose hashes are at level 0.
+    // New nodes are built, but the old trie is left as it is.
+    void prepare(unsigned slot, BatchChange *begin, BatchChange *end,
+                 Transaction &txn);
+
+    // Write the new entries into the old nodes and the table, and free what
+    // they replaced. Nothing is allocated, so this can't fail.
+    void commit(Transaction &txn);
+
+    // Free everything prepare() built.
+    void rollback(Transaction &txn);
+
     HamtNodeEntry table[MAX_IDX];
+
+    HamtNodePool pool;
+
+    // Whether the leaves are HamtCountedLeafs.
+    bool counted;
+
+    HamtLeafSlab leafSlab;
+
+    size_t nKeys = 0;
+
+    // The total length of the keys, for reserve() to estimate their average
+    // length.
+    size_t keyBytes = 0;
+
+    // While there are fewer keys than this, nodes that get replaced go into
+    // the pool, for the nodes reserve() didn't foresee.
+    size_t reservedKeys = 0;
+
+    // Compaction proceeds in units of one subtree of a first-level node (a
+    // node directly in the table); there are MAX_IDX + 1 units per table
+    // entry: first the first-level node itself, which goes into `topArena`
+    // with the other first-level nodes, then each of its children's
+    // subtrees, which go into `arena`.
+    static constexpr unsigned COMPACTION_UNITS = MAX_IDX * (MAX_IDX + 1);
+
+    // The next unit to compact, if a pass is in progress.
+    unsigned compactionCursor = 0;
+    bool compacting = false;
+
+    HamtNodeArena topArena;
+    HamtNodeArena arena;
+
+    // The arenas from before the pass in progress. Once every node has been
+    // moved out, they're freed.
+    std::vector<HamtNodeArena> oldArenas;
 };
 
+// A handle to a string stored in a Hamt, from Hamt::intern().
+//
+// A handle stays valid, and keeps pointing to the same string, until that
+// string is erased or the Hamt is cleared or destroyed. Inserts, erases of
+// other strings, compaction and moving the Hamt all leave it alone. Two
+// handles from the same Hamt are equal exactly when their strings are, so
+// handles can be compared and hashed in place of the strings.
+//
+// The view returned by str() is good for as long as the handle, since a
+// string's bytes are kept with its leaf and never move.
+class HamtHandle {
+  public:
+    // Initialize a NULL handle, which refers to nothing.
+    HamtHandle();
+
+    // Test whether this handle refers to a string.
+    explicit operator bool() const;
+
+    // The string this handle refers to, which must not be NULL.
+    std::string_view str() const;
+
+    bool operator==(const HamtHandle &other) const;
+    bool operator!=(const HamtHandle &other) const;
+
+  private:
+    friend class Hamt;
+    friend struct std::hash<HamtHandle>;
+
+    explicit HamtHandle(const HamtLeaf *leaf);
+
+    // Leaves are never moved once allocated, only the pointers to them.
+    const HamtLeaf *leaf;
+};
+
+namespace std {
+template <> struct hash<HamtHandle> {
+    size_t operator()(const HamtHandle &handle) const {
+        return hash<const HamtLeaf *>()(handle.leaf);
+    }
+};
+} // namespace std
+
+// A list of changes to make to a Hamt at once, with Hamt::apply().
+//
+// Changes are made in the order they were added, so if a string is both
+// inserted and erased, the last of them wins.
+class HamtBatch {
+  public:
+    // Add the string to the set.
+    void insert(std::string str);
+
+    // Remove the string from the set.
+    void erase(std::string str);
+
+    // The number of changes in the batch.
+    size_t size() const;
+
+    void clear();
+
+  private:
+    friend class Hamt;
+
+    struct Change {
+        std::string str;
+        bool insert;
+    };
+
+    std::vector<Change> changes;
+};
+
+class HamtReclaimer;
+
 // The HAMT itself. Users should only use this interface.
 class Hamt {
   public:
     // Initialize an empty HAMT.
     Hamt() = default;
 
+    // Moving a HAMT is O(1); the moved-from HAMT is left empty.
+    Hamt(Hamt &&other) = default;
+    Hamt &operator=(Hamt &&other) = default;
+
+    void swap(Hamt &other);
+
+    // Remove every string from the set.
+    //
+    // If `keepMemory` is set, the memory of the trie's nodes is kept around
+    // and reused by later inserts, rather than going back to the allocator.
+    void clear(bool keepMemory = false);
+
+    // Remove every string from the set in O(1), leaving the work of freeing
+    // them to `reclaimer`'s background thread.
+    void clear(HamtReclaimer &reclaimer);
+
+    // Rewrite the trie's nodes into fresh contiguous memory, in depth-first
+    // order, with the nodes just below the top level packed together in their
+    // own block. If a pass of compactStep() is in progress, finish it
+    // instead.
+    //
+    // After a long run of inserts and erases the nodes are scattered over the
+    // heap; compacting puts each node close to its parent, so lookups touch
+    // fewer pages and cache lines.
+    void compact();
+
+    // Do a bounded slice of compaction: relocate at least `budget` nodes (or
+    // the rest of the trie), resuming where the last call stopped. Inserts
+    // and erases may run between slices. Return true when a full pass over
+    // the trie has finished.
+    bool compactStep(size_t budget);
+
     // Insert a string into the set.
     void insert(std::string &&str);
 
+    // The number of strings in the set.
+    size_t size() const;
+
+    // Prepare for the set to grow to `n` strings, so that inserting them
+    // makes hardly any calls to the allocator.
+    //
+    // Nodes are allocated up front, in the sizes a trie of `n` strings is
+    // expected to need, and until the set reaches `n` strings, nodes outgrown
+    // by an insert are kept for reuse rather than freed. Leaves come from a
+    // single block. If `averageLength` is given, or can be estimated from the
+    // strings already in the set, room is set aside for the strings' bytes
+    // too, in the same block. The memory of leaves in that
+    // block, once erased, is only reused after clear().
+    void reserve(size_t n, size_t averageLength = 0);
+
+    // Insert a string into the set if it isn't there yet, and return a
+    // handle to the set's copy of it.
+    //
+    // Interning every occurrence of a token keeps a single copy of it, and
+    // gives each distinct token a single handle.
+    HamtHandle intern(std::string_view str);
+
     // Lookup a string in the set.
     bool find(const std::string &str) const;
 
     // Delete a string from the set.
     //
     // Return whether the string was found.
+    //
+    // The trie is left exactly as it would be had the string never been
+    // inserted, so it doesn't get any deeper under churn.
     bool erase(const std::string &str);
 
+    // Delete every string for which `pred` returns true, and return how many
+    // there were.
+    //
+    // Rather than erasing the strings one at a time, this walks the trie
+    // once, and rebuilds each node at most once, dropping all of its erased
+    // children together. With more than one thread, the entries of the
+    // top-level node are shared out among them, and `pred` is called
+    // concurrently. The threaded sweep is tested for correctness, but any
+    // speedup from it is unverified: it has only been benchmarked on one
+    // core, where extra threads make it slightly slower.
+    size_t eraseIf(const std::function<bool(std::string_view)> &pred,
+                   unsigned threads = 1);
+
+    // Delete every string for which `pred` returns false, as eraseIf() does.
+    size_t retainIf(const std::function<bool(std::string_view)> &pred,
+                    unsigned threads = 1);
+
+    // Delete the `n` strings at `keys` (or those of them in the set), and
+    // return how many were found.
+    //
+    // The strings are sorted by hash, so that only the nodes on their paths
+    // are visited, and each of those is rebuilt at most once. Threads are
+    // used as for eraseIf(), and as there, any speedup from them is
+    // unverified.
+    size_t eraseBatch(const std::string *keys, size_t n, unsigned threads = 1);
+
+    // Make all the changes in `batch`, leaving it empty.
+    //
+    // The changes are sorted by hash, and each node on their paths whose
+    // children come or go is built afresh just once, with its final set of
+    // children, while the old trie is left alone. Only then are the new
+    // nodes written into the old ones and the replaced nodes freed, a step
+    // that allocates nothing. If an allocation fails before that, the new
+    // nodes are freed and std::bad_alloc is thrown, with the set as it was.
+    //
+    // That makes apply() all-or-nothing with respect to failure only. The
+    // new nodes are written in one at a time, with no synchronization, so a
+    // concurrent reader could see the batch partly applied. Callers must keep
+    // other threads from reading the set while apply() runs, as for any
+    // other change.
+    //
+    // Strings the batch doesn't erase keep their handles, even when their
+    // leaves move up or down the trie.
+    void apply(HamtBatch &&batch);
+
+    // Walk the trie to describe its shape.
+    HamtShape shape() const;
+
+    // Draw `k` distinct strings from the set, uniformly at random, or all of
+    // them if there are no more than `k`. They come in no particular order.
+    //
+    // Every node keeps count of the strings under it, so each draw takes a
+    // single walk down the trie, weighing each child by its count.
+    template <typename Rng>
+    std::vector<std::string> sample(Rng &rng, size_t k) const;
+
+    // Approximately how many strings in the set have a hash that comes before
+    // `hash` (as std::hash<std::string_view> would give it), ordering hashes
+    // by their lowest BITS_PER_LEVEL bits, then the next, and so on.
+    //
+    // Only the first `levels` levels of the trie are visited, so the time
+    // taken doesn't grow with the set. At each level, though, the sizes of
+    // the entries that come before `hash` are added up one by one, so this
+    // takes O(levels * MAX_IDX) time, and reads up to MAX_IDX nodes per
+    // level (prefetched together). The strings under the last entry visited
+    // are counted as if spread evenly over the hashes it covers. In that
+    // order, the strings whose hashes share their lowest bits are
+    // contiguous, so the difference of two ranks is roughly how many strings
+    // fall in a shard of the hash space.
+    size_t approximateRank(std::uint64_t hash, unsigned levels = 2) const;
+
+    // Make an immutable copy of the set, laid out for lookups. The HAMT
+    // itself is left as it is.
+    FrozenHamt freeze() const;
+
+  private:
+    friend class HamtReclaimer;
+
+    TopLevelHamtNode root;
+#ifdef TEST_HASH
+    std::uint64_t hasher(std::string_view) const { return 0; }
+#else
+    std::hash<std::string_view> hasher;
+#endif
+};
+
+template <typename Rng>
+std::vector<std::string> Hamt::sample(Rng &rng, size_t k) const {
+    std::uint64_t n = size();
+    k = std::min<std::uint64_t>(k, n);
+
+    // Floyd's algorithm picks `k` distinct ranks with `k` draws.
+    std::unordered_set<std::uint64_t> chosen;
+    std::vector<std::string> result;
+    result.reserve(k);
+    for (std::uint64_t j = n - k; j < n; ++j) {
+        std::uint64_t rank =
+            std::uniform_int_distribution<std::uint64_t>(0, j)(rng);
+        if (!chosen.insert(rank).second) {
+            rank = j;
+            chosen.insert(rank);
+        }
+        result.emplace_back(root.nth(rank).key());
+    }
+    return result;
+}
+
+// A multiset of strings, counting how many times each has been added.
+//
+// It's the same trie as a Hamt, with each string's count kept in its leaf, so
+// that adding a string takes a single walk down the trie (and a single hash)
+// whether or not it was already there.
+class CountingHamt {
+  public:
+    // Initialize an empty multiset.
+    CountingHamt();
+
+    // Moving a CountingHamt is O(1); the moved-from one is left empty.
+    CountingHamt(CountingHamt &&other) = default;
+    CountingHamt &operator=(CountingHamt &&other) = default;
+
+    // Add `delta` occurrences of `str`, and return how many there are now.
+    //
+    // Adding no occurrences of a string that isn't there leaves it out.
+    std::uint64_t add(std::string_view str, std::uint64_t delta = 1);
+
+    // The number of occurrences of `str`, which is 0 if it isn't there.
+    std::uint64_t count(std::string_view str) const;
+
+    // Take away `delta` occurrences of `str` (or all of them, if there are
+    // fewer), and return how many are left. Once none are left, the string
+    // is erased, leaving the trie as if it had never been added.
+    std::uint64_t remove(std::string_view str, std::uint64_t delta = 1);
+
+    // The number of distinct strings.
+    size_t size() const;
+
+    // Prepare for `n` distinct strings, as Hamt::reserve() does.
+    void reserve(size_t n, size_t averageLength = 0);
+
+    // Remove every string, as Hamt::clear() does.
+    void clear(bool keepMemory = false);
+
+    // Walk the trie to describe its shape.
+    HamtShape shape() const;
+
   private:
     TopLevelHamtNode root;
+#ifdef TEST_HASH
+    std::uint64_t hasher(std::string_view) const { return 0; }
+#else
+    std::hash<std::string_view> hasher;
+#endif
+};
+
+// A node of a FrozenHamt.
+//
+// Where a HamtNode has one bitmap and a table of tagged pointers, a frozen
+// node has a bitmap each for its child nodes and its leaves, and the index of
+// the first of each. A node's children are stored next to one another, so the
+// index of any one of them is the first index plus its rank in the bitmap.
+struct FrozenHamtNode {
+    std::uint64_t nodeMap;
+    std::uint64_t leafMap;
+    std::uint32_t firstNode;
+    std::uint32_t firstLeaf;
+};
+
+// A key of a FrozenHamt.
+struct FrozenHamtLeaf {
+    // Where the key starts in the blob of key bytes.
+    std::uint64_t offset;
+
+    std::uint32_t length;
+
+    // The 32 bits of the key's hash just above those that index its entry,
+    // compared before the key itself.
+    std::uint32_t fingerprint;
+};
+
+// An immutable set of strings, made by Hamt::freeze().
+//
+// It holds the same trie as the Hamt it was made from, but in three flat
+// arrays rather than one allocation per node and key: the nodes, in
+// breadth-first order starting from the top level, in a single block aligned
+// to a cache line; the keys' offsets, lengths and fingerprints; and the bytes
+// of every key, packed end to end. There are no tagged pointers to follow, and
+// the nodes near the top, which every lookup goes through, share a few cache
+// lines.
+class FrozenHamt {
+  public:
+    // Initialize an empty set.
+    FrozenHamt();
+
+    // Moving a FrozenHamt is O(1).
+    FrozenHamt(FrozenHamt &&other);
+    FrozenHamt &operator=(FrozenHamt &&other);
+
+    // Lookup a string in the set.
+    bool find(const std::string &str) const;
+
+    // Lookup `n` strings at once, setting `found[i]` if `keys[i]` is in the
+    // set.
+    //
+    // The lookups are interleaved level by level, prefetching each key's
+    // next node, so that the cache misses of different keys overlap.
+    void find(const std::string *keys, size_t n, bool *found) const;
+
+    // The number of strings in the set.
+    size_t size() const;
+
+    // Iterates over the strings in the set, in no particular order.
+    class Iterator {
+      public:
+        std::string_view operator*() const;
+        Iterator &operator++();
+        bool operator!=(const Iterator &other) const;
+
+      private:
+        friend class FrozenHamt;
+
+        Iterator(const FrozenHamt *set, size_t idx);
+
+        const FrozenHamt *set;
+        size_t idx;
+    };
+
+    Iterator begin() const;
+    Iterator end() const;
+
+  private:
+    friend class TopLevelHamtNode;
+
+    // Whether leaf number `idx` holds `str`, which has the given hash at the
+    // leaf's level.
+    bool matches(std::uint32_t idx, std::uint64_t hash,
+                 const std::string &str) const;
+
+    struct FreeDeleter {
+        void operator()(FrozenHamtNode *nodes) const;
+    };
+
+    // The first node is the top level.
+    std::unique_ptr<FrozenHamtNode[], FreeDeleter> nodes;
+    std::vector<FrozenHamtLeaf> leaves;
+    std::vector<char> blob;
+
 #ifdef TEST_HASH
     std::uint64_t hasher(const std::string &) const { return 0; }
 #else
     std::hash<std::string> hasher;
 #endif
 };
+
+// Frees retired HAMTs on a background thread.
+//
+// Destroying a large HAMT means freeing every node and key one by one, which
+// can take seconds. Handing it to a reclaimer instead costs one small
+// allocation.
+class HamtReclaimer {
+  public:
+    // Start the background thread.
+    HamtReclaimer();
+    HamtReclaimer(const HamtReclaimer &) = delete;
+
+    // Free everything still waiting, and stop the thread.
+    ~HamtReclaimer();
+
+    // Take the contents of `hamt` to be freed in the background, leaving it
+    // empty.
+    void retire(Hamt &&hamt);
+
+    // Wait until everything retired so far has been freed.
+    void drain();
+
+  private:
+    void run();
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable drained;
+    std::vector<std::unique_ptr<TopLevelHamtNode>> queue;
+    bool busy = false;
+    bool stopping = false;
+    std::thread thread;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Instrumentation.
+//
+// When the library is compiled with HAMT_STATS defined, every operation
+// updates a set of per-thread counters, and can optionally report its latency
+// to a callback. Without HAMT_STATS the hooks compile away entirely, so there
+// is no cost to leaving them in the hot paths.
+//
+
+// Counters for the work done by the trie, accumulated per thread. Divide by
+// `operations` to get per-operation figures.
+struct HamtCounters {
+    // Calls to Hamt::insert, Hamt::find and Hamt::erase, and to their
+    // CountingHamt counterparts.
+    std::uint64_t operations = 0;
+
+    // Levels descended below the top-level node.
+    std::uint64_t levelsTraversed = 0;
+
+    // HamtNodes reallocated to add or remove a child.
+    std::uint64_t nodeReallocations = 0;
+
+    // Leaves pushed down into a new node because another key collided with
+    // them on insert.
+    std::uint64_t leafSplits = 0;
+
+    // Calls to compute a backup hash once the original hash is exhausted.
+    std::uint64_t backupHashes = 0;
+
+    // Full key comparisons against a leaf.
+    std::uint64_t stringComparisons = 0;
+};
+
+enum class HamtOperation { Insert, Find, Erase };
+
+// Called with each sampled operation and its latency in nanoseconds.
+using HamtLatencyCallback = void (*)(HamtOperation op,
+                                     std::uint64_t nanoseconds,
+                                     void *context);
+
+#ifdef HAMT_STATS
+// Get the calling thread's counters.
+HamtCounters &hamtCounters();
+
+// Zero the calling thread's counters.
+void hamtResetCounters();
+
+// Time one in every `period` operations on the calling thread and report it
+// to `callback`. Pass a NULL callback to stop sampling.
+void hamtSetLatencySampler(HamtLatencyCallback callback, void *context,
+                           std::uint32_t period);
+#endif
@@ -1,8 +1,17 @@
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <cmath>
 #include <cstdint>
+#include <cstdlib>
 #include <cstring>
+#include <functional>
+#include <mutex>
+#include <new>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <vector>
 
 #include "HAMT.hh"
@@ -18,6 +27,69 @@
 #define LIKELY(condition) __builtin_expect(static_cast<bool>(condition), 1)
 #define UNLIKELY(condition) __builtin_expect(static_cast<bool>(condition), 0)
 
+//////////////////////////////////////////////////////////////////////////////
+// Instrumentation.
+//
+
+#ifdef HAMT_STATS
+
+static thread_local HamtCounters counters;
+
+static thread_local HamtLatencyCallback samplerCallback = NULL;
+static thread_local void *samplerContext = NULL;
+static thread_local std::uint32_t samplerPeriod = 0;
+static thread_local std::uint32_t samplerCountdown = 0;
+
+HamtCounters &hamtCounters() { return counters; }
+
+void hamtResetCounters() { counters = HamtCounters(); }
+
+void hamtSetLatencySampler(HamtLatencyCallback callback, void *context,
+                           std::uint32_t period) {
+    samplerCallback = callback;
+    samplerContext = context;
+    samplerPeriod = period == 0 ? 1 : period;
+    samplerCountdown = samplerPeriod;
+}
+
+// Counts a single public operation, and times it if it is the one in
+// `samplerPeriod` that gets sampled.
+class OperationProbe {
+  public:
+    explicit OperationProbe(HamtOperation op) : op(op), sampled(false) {
+        counters.operations++;
+        if (UNLIKELY(samplerCallback != NULL) && --samplerCountdown == 0) {
+            samplerCountdown = samplerPeriod;
+            sampled = true;
+            start = std::chrono::steady_clock::now();
+        }
+    }
+
+    ~OperationProbe() {
+        if (UNLIKELY(sampled)) {
+            auto diff = std::chrono::steady_clock::now() - start;
+            auto ns =
+                std::chrono::duration_cast<std::chrono::nanoseconds>(diff);
+            samplerCallback(op, ns.count(), samplerContext);
+        }
+    }
+
+  private:
+    HamtOperation op;
+    bool sampled;
+    std::chrono::steady_clock::time_point start;
+};
+
+#define COUNT(counter) (counters.counter++)
+#define PROBE(op) OperationProbe probe(op)
+
+#else
+
+#define COUNT(counter) ((void)0)
+#define PROBE(op) ((void)0)
+
+#endif
+
 //////////////////////////////////////////////////////////////////////////////
 // Hash definitions.
 //
@@ -40,7 +112,8 @@
 // Since we use up 4 bytes per iteration of this procedure, we'll separate
 // the key from any different in time and space linear in the size of the
 // key.
-uint64_t getNthBackup(const std::string &str, unsigned n) {
+uint64_t getNthBackup(std::string_view str, unsigned n) {
+    COUNT(backupHashes);
     std::uint64_t result = 0;
     uint8_t *bytes = (uint8_t *)&result;
 
@@ -56,18 +129,255 @@ uint64_t getNthBackup(const std::string &str, unsigned n) {
     return result;
 }
 
+// Whether moving from `level - 1` to `level` starts a new backup hash rather
+// than shifting the current one.
+static bool isBackupLevel(unsigned level) {
+    return level >= LEVELS_PER_HASH && (level % LEVELS_PER_HASH) == 0;
+}
+
+// Advance `hash` from `level - 1` to `level`, where it indexes the entries
+// for `str`.
+static uint64_t nextHash(uint64_t hash, unsigned level,
+                         std::string_view str) {
+    if (UNLIKELY(isBackupLevel(level))) {
+        return getNthBackup(str, level / LEVELS_PER_HASH - 1);
+    }
+    return hash >> BITS_PER_LEVEL;
+}
+
+// Inserts and erases keep track of this many of the nodes on a key's path,
+// which is every node unless the key shares a hash with another.
+static constexpr size_t PATH_BUFFER = 2 * LEVELS_PER_HASH;
+
 //////////////////////////////////////////////////////////////////////////////
 // TopLevelHamtNode method definitions.
 //
 
-void TopLevelHamtNode::insert(uint64_t hash, std::string &&str) {
+TopLevelHamtNode::TopLevelHamtNode(bool counted) : counted(counted) {}
+
+TopLevelHamtNode::TopLevelHamtNode(TopLevelHamtNode &&other)
+    : pool(std::move(other.pool)), counted(other.counted),
+      leafSlab(std::move(other.leafSlab)), nKeys(other.nKeys),
+      keyBytes(other.keyBytes), reservedKeys(other.reservedKeys),
+      compactionCursor(other.compactionCursor),
+      compacting(other.compacting), topArena(std::move(other.topArena)),
+      arena(std::move(other.arena)), oldArenas(std::move(other.oldArenas)) {
+    for (uint64_t i = 0; i < MAX_IDX; ++i) {
+        table[i] = std::move(other.table[i]);
+    }
+    other.nKeys = 0;
+    other.keyBytes = 0;
+    other.reservedKeys = 0;
+    other.compacting = false;
+}
+
+TopLevelHamtNode &TopLevelHamtNode::operator=(TopLevelHamtNode &&other) {
+    destroy(NULL);
+    for (uint64_t i = 0; i < MAX_IDX; ++i) {
+        table[i] = std::move(other.table[i]);
+    }
+    pool = std::move(other.pool);
+    counted = other.counted;
+    leafSlab = std::move(other.leafSlab);
+    nKeys = other.nKeys;
+    keyBytes = other.keyBytes;
+    reservedKeys = other.reservedKeys;
+    other.nKeys = 0;
+    other.keyBytes = 0;
+    other.reservedKeys = 0;
+    compactionCursor = other.compactionCursor;
+    compacting = other.compacting;
+    topArena = std::move(other.topArena);
+    arena = std::move(other.arena);
+    oldArenas = std::move(other.oldArenas);
+    other.compacting = false;
+    return *this;
+}
+
+// The arenas are freed after this, as members.
+TopLevelHamtNode::~TopLevelHamtNode() { destroy(NULL); }
+
+void TopLevelHamtNode::clear(bool keepMemory) {
+    if (keepMemory) {
+        destroy(&pool);
+        leafSlab.rewind();
+    } else {
+        destroy(NULL);
+        pool.clear();
+        leafSlab.clear();
+        reservedKeys = 0;
+    }
+
+    nKeys = 0;
+    keyBytes = 0;
+    compacting = false;
+    topArena.clear();
+    arena.clear();
+    oldArenas.clear();
+}
+
+bool TopLevelHamtNode::compact(size_t budget) {
+    if (!compacting) {
+        // Start a new pass. Everything relocated by the last one moves out
+        // of its arenas, into new ones.
+        oldArenas.push_back(std::move(topArena));
+        oldArenas.push_back(std::move(arena));
+        topArena = HamtNodeArena();
+        arena = HamtNodeArena();
+
+        size_t topBytes = 0;
+        for (const auto &entry : table) {
+            if (!entry.isNull() && !entry.isLeaf()) {
+                int nChildren = entry.getChild().numberOfChildren();
+                topBytes += HamtNode::allocationSize(nChildren);
+            }
+        }
+        topArena.reserve(topBytes);
+
+        compactionCursor = 0;
+        compacting = true;
+    }
+
+    size_t moved = 0;
+    while (moved < budget && compactionCursor < COMPACTION_UNITS) {
+        unsigned slot = compactionCursor / (MAX_IDX + 1);
+        unsigned unit = compactionCursor % (MAX_IDX + 1);
+        compactionCursor++;
+
+        HamtNodeEntry *entry = &table[slot];
+        if (entry->isNull() || entry->isLeaf()) {
+            // There's nothing below this entry; skip the rest of its units.
+            compactionCursor = (slot + 1) * (MAX_IDX + 1);
+            continue;
+        }
+
+        if (unit == 0) {
+            // Just the first-level node itself; its children come next.
+            HamtNode &node = entry->getChild();
+            int nChildren = node.numberOfChildren();
+            void *memory = topArena.allocate(nChildren);
+            std::memcpy(memory, &node, HamtNode::allocationSize(nChildren));
+            node.forgetChildren();
+
+            HamtNode *copy = static_cast<HamtNode *>(memory);
+            *entry = HamtNodeEntry(HamtNodePtr(copy, HamtNodeDeleter{true}));
+            moved++;
+            continue;
+        }
+
+        HamtNode &node = entry->getChild();
+        uint64_t hash = unit - 1;
+        if (node.containsHash(hash)) {
+            auto child = &node.children[node.numberOfHashesAbove(hash) - 1];
+            moved += relocate(child, arena);
+        }
+    }
+
+    if (compactionCursor < COMPACTION_UNITS) {
+        return false;
+    }
+
+    // Nothing can point into the old arenas any more.
+    oldArenas.clear();
+    compacting = false;
+    return true;
+}
+
+size_t TopLevelHamtNode::relocate(HamtNodeEntry *entry,
+                                  HamtNodeArena &arena) {
+    size_t moved = 0;
+    std::vector<HamtNodeEntry *> stack;
+    stack.push_back(entry);
+
+    while (!stack.empty()) {
+        entry = stack.back();
+        stack.pop_back();
+
+        if (entry->isNull() || entry->isLeaf()) {
+            continue;
+        }
+
+        // Copy the node bit for bit, then empty the original so that
+        // deleting it leaves the children alone.
+        HamtNodePtr node = entry->takeChild();
+        int nChildren = node->numberOfChildren();
+        void *memory = arena.allocate(nChildren);
+        std::memcpy(memory, node.get(), HamtNode::allocationSize(nChildren));
+        node->forgetChildren();
+        node.reset();
+
+        HamtNode *copy = static_cast<HamtNode *>(memory);
+        *entry = HamtNodeEntry(HamtNodePtr(copy, HamtNodeDeleter{true}));
+        moved++;
+
+        // Children are visited first to last, so push them in reverse.
+        for (int i = nChildren - 1; i >= 0; --i) {
+            stack.push_back(&copy->children[i]);
+        }
+    }
+
+    return moved;
+}
+
+// Free a subtree without recursing, putting node memory into `pool` if it's
+// non-NULL.
+static void freeSubtree(HamtNodePtr root, HamtNodePool *pool) {
+    std::vector<HamtNodePtr> stack;
+    stack.push_back(std::move(root));
+
+    while (!stack.empty()) {
+        HamtNodePtr node = std::move(stack.back());
+        stack.pop_back();
+
+        // Detach the node's children before freeing it, so that its
+        // destructor doesn't recurse into them.
+        int nChildren = node->numberOfChildren();
+        for (int i = 0; i < nChildren; ++i) {
+            HamtNodeEntry &child = node->children[i];
+            if (child.isLeaf()) {
+                child = HamtNodeEntry();
+            } else if (!child.isNull()) {
+                stack.push_back(child.takeChild());
+            }
+        }
+
+        // Nodes in an arena only get destroyed; the pool can only take
+        // memory from the allocator.
+        if (pool != NULL && !node.get_deleter().inArena) {
+            HamtNode *raw = node.release();
+            raw->~HamtNode();
+            pool->release(raw, nChildren);
+        }
+    }
+}
+
+void TopLevelHamtNode::destroy(HamtNodePool *pool) {
+    for (auto &entry : table) {
+        if (entry.isNull()) {
+            continue;
+        } else if (entry.isLeaf()) {
+            entry = HamtNodeEntry();
+        } else {
+            freeSubtree(entry.takeChild(), pool);
+        }
+    }
+}
+
+HamtLeaf &TopLevelHamtNode::insert(uint64_t hash, std::string_view str) {
     HamtNodeEntry *entryToInsert = &table[hash & FIRST_N_BITS];
     unsigned level = 0;
 
+    // The nodes passed through on the way down, which gain a leaf if the key
+    // turns out to be new.
+    uint64_t rootHash = hash;
+    HamtNode *path[PATH_BUFFER];
+    size_t depth = 0;
+
     if (entryToInsert->isNull()) {
-        auto leaf = std::make_unique<HamtLeaf>(std::move(str), hash);
+        auto leaf = newLeaf(hash, str);
+        HamtLeaf &result = *leaf;
         *entryToInsert = HamtNodeEntry(std::move(leaf));
-        return;
+        return result;
     }
 
     // Some loop invariants:
@@ -82,9 +392,9 @@ void TopLevelHamtNode::insert(uint64_t hash, std::string &&str) {
         unsigned lastLevel = level;
         uint64_t lastHash = hash;
         level++;
+        COUNT(levelsTraversed);
 
-        if (UNLIKELY(level >= LEVELS_PER_HASH) &&
-            (level % LEVELS_PER_HASH) == 0) {
+        if (UNLIKELY(isBackupLevel(level))) {
             hash = getNthBackup(str, level / LEVELS_PER_HASH - 1);
         } else {
             hash >>= BITS_PER_LEVEL;
@@ -97,6 +407,10 @@ void TopLevelHamtNode::insert(uint64_t hash, std::string &&str) {
             // If there's already a child here, move into that child.
             if (nodeToInsertAt->containsHash(hash)) {
                 auto nextEntry = &nodeToInsertAt->children[idx - 1];
+                if (depth < PATH_BUFFER) {
+                    path[depth] = nodeToInsertAt.get();
+                }
+                depth++;
                 *entryToInsert = HamtNodeEntry(std::move(nodeToInsertAt));
                 entryToInsert = nextEntry;
                 continue;
@@ -105,34 +419,56 @@ void TopLevelHamtNode::insert(uint64_t hash, std::string &&str) {
             } else {
                 int nChildren = nodeToInsertAt->numberOfChildren() + 1;
 
-                auto leaf = std::make_unique<HamtLeaf>(std::move(str), hash);
-
-                std::unique_ptr<HamtNode> newNode(new (nChildren) HamtNode(
+                auto leaf = newLeaf(hash, str);
+                HamtLeaf &result = *leaf;
+
+                // While a reservation lasts, keep the outgrown node for some
+                // other node to grow into, handing the constructor a pointer
+                // that only destroys it.
+                HamtNode *outgrown = NULL;
+                if (nKeys <= reservedKeys &&
+                    !nodeToInsertAt.get_deleter().inArena) {
+                    outgrown = nodeToInsertAt.release();
+                    nodeToInsertAt =
+                        HamtNodePtr(outgrown, HamtNodeDeleter{true});
+                }
+
+                HamtNodePtr newNode(new (pool, nChildren) HamtNode(
                     std::move(nodeToInsertAt), HamtNodeEntry(std::move(leaf)),
                     hash));
 
+                if (outgrown != NULL) {
+                    pool.release(outgrown, nChildren - 1);
+                }
+
                 *entryToInsert = HamtNodeEntry(std::move(newNode));
-                return;
+                resizePath(path, depth, rootHash, str, 1);
+                return result;
             }
         } else {
             auto otherLeaf = entryToInsert->takeLeaf();
             auto otherHash = otherLeaf->hash;
 
-            if (lastHash == otherHash && str == otherLeaf->data) {
-                *entryToInsert = HamtNodeEntry(std::move(otherLeaf));
-                return;
+            if (lastHash == otherHash) {
+                COUNT(stringComparisons);
+                if (str == otherLeaf->key()) {
+                    HamtLeaf &result = *otherLeaf;
+                    *entryToInsert = HamtNodeEntry(std::move(otherLeaf));
+                    return result;
+                }
             }
 
-            if (UNLIKELY(level >= LEVELS_PER_HASH) &&
-                (level % LEVELS_PER_HASH) == 0) {
+            COUNT(leafSplits);
+
+            if (UNLIKELY(isBackupLevel(level))) {
                 otherHash =
-                    getNthBackup(otherLeaf->data, level / LEVELS_PER_HASH - 1);
+                    getNthBackup(otherLeaf->key(), level / LEVELS_PER_HASH - 1);
             } else {
                 otherHash >>= BITS_PER_LEVEL;
             }
             otherLeaf->hash = otherHash;
 
-            std::unique_ptr<HamtNode> newNode(new (1) HamtNode(
+            HamtNodePtr newNode(new (pool, 1) HamtNode(
                 otherHash, HamtNodeEntry(std::move(otherLeaf))));
 
             *entryToInsert = HamtNodeEntry(std::move(newNode));
@@ -143,24 +479,243 @@ void TopLevelHamtNode::insert(uint64_t hash, std::string &&str) {
     }
 }
 
-bool TopLevelHamtNode::find(uint64_t hash, const std::string &str) const {
+size_t TopLevelHamtNode::size() const { return nKeys; }
+
+void TopLevelHamtNode::resizePath(HamtNode **path, size_t depth,
+                                  uint64_t hash, std::string_view str,
+                                  int64_t delta) {
+    for (size_t i = 0; i < std::min<size_t>(depth, PATH_BUFFER); ++i) {
+        path[i]->size += delta;
+    }
+    if (LIKELY(depth <= PATH_BUFFER)) {
+        return;
+    }
+
+    // The rest were too deep to keep track of, so find them again.
+    HamtNodeEntry *entry = &table[hash & FIRST_N_BITS];
+    for (size_t i = 0; i < depth; ++i) {
+        HamtNode &node = entry->getChild();
+        if (i >= PATH_BUFFER) {
+            node.size += delta;
+        }
+        hash = nextHash(hash, i + 1, str);
+        entry = &node.children[node.numberOfHashesAbove(hash) - 1];
+    }
+}
+
+// Prefetch the nodes among `n` entries, whose sizes are about to be read.
+static void prefetchSizes(const HamtNodeEntry *entries, int n) {
+    for (int i = 0; i < n; ++i) {
+        if (!entries[i].isNull() && !entries[i].isLeaf()) {
+            __builtin_prefetch(&entries[i].getChild());
+        }
+    }
+}
+
+const HamtLeaf &TopLevelHamtNode::nth(uint64_t rank) const {
+    assert(rank < nKeys);
+
+    prefetchSizes(table, MAX_IDX);
+    const HamtNodeEntry *entry = &table[0];
+    while (rank >= entry->size()) {
+        rank -= entry->size();
+        entry++;
+    }
+
+    while (!entry->isLeaf()) {
+        // Children are sorted from high to low bits, so go from the last.
+        const HamtNode &node = entry->getChild();
+        int nChildren = node.numberOfChildren();
+        prefetchSizes(node.children, nChildren);
+        entry = &node.children[nChildren - 1];
+        while (rank >= entry->size()) {
+            rank -= entry->size();
+            entry--;
+        }
+    }
+
+    return entry->getLeaf();
+}
+
+size_t TopLevelHamtNode::approximateRank(uint64_t hash,
+                                         unsigned levels) const {
+    uint64_t rank = 0;
+    prefetchSizes(table, hash & FIRST_N_BITS);
+    for (uint64_t i = 0; i < (hash & FIRST_N_BITS); ++i) {
+        rank += table[i].size();
+    }
+
+    const HamtNodeEntry *entry = &table[hash & FIRST_N_BITS];
+    for (unsigned level = 1;; ++level) {
+        if (entry->isNull()) {
+            return rank;
+        } else if (entry->isLeaf()) {
+            // Compare the first index at which the hashes differ.
+            uint64_t diff = entry->getLeaf().hash ^ hash;
+            if (diff == 0) {
+                return rank;
+            }
+            unsigned shift = __builtin_ctzll(diff) / BITS_PER_LEVEL *
+                             BITS_PER_LEVEL;
+            uint64_t leafIdx = (entry->getLeaf().hash >> shift) & FIRST_N_BITS;
+            return rank + (leafIdx < ((hash >> shift) & FIRST_N_BITS));
+        } else if (level >= levels || isBackupLevel(level)) {
+            break;
+        }
+
+        // Count the children with lower indexes.
+        hash >>= BITS_PER_LEVEL;
+        const HamtNode &node = entry->getChild();
+        int nChildren = node.numberOfChildren();
+        int above = node.numberOfHashesAbove(hash);
+        prefetchSizes(&node.children[above], nChildren - above);
+        for (int i = above; i < nChildren; ++i) {
+            rank += node.children[i].size();
+        }
+        if (!node.containsHash(hash)) {
+            return rank;
+        }
+        entry = &node.children[above - 1];
+    }
+
+    // Spread the keys under `entry` evenly over the hashes it covers, of
+    // which the next few indexes are plenty to place `hash`.
+    double fraction = 0;
+    double scale = 1;
+    for (int i = 0; i < 4; ++i) {
+        hash >>= BITS_PER_LEVEL;
+        scale /= MAX_IDX;
+        fraction += (hash & FIRST_N_BITS) * scale;
+    }
+    return rank + static_cast<uint64_t>(entry->size() * fraction);
+}
+
+// The number of bytes a leaf takes, with its key.
+static size_t leafSize(bool counted, size_t length) {
+    return (counted ? sizeof(HamtCountedLeaf) : sizeof(HamtLeaf)) + length;
+}
+
+HamtLeafPtr TopLevelHamtNode::newLeaf(uint64_t hash, std::string_view str) {
+    assert(str.size() < UINT32_MAX);
+    size_t size = leafSize(counted, str.size());
+    void *memory = leafSlab.allocate(size);
+    bool inSlab = memory != NULL;
+    if (!inSlab) {
+        memory = ::operator new(size);
+    }
+    uint32_t offset = size - str.size();
+    HamtLeaf *raw;
+    if (counted) {
+        raw = new (memory) HamtCountedLeaf(hash, str.size(), offset);
+    } else {
+        raw = new (memory) HamtLeaf(hash, str.size(), offset);
+    }
+    HamtLeafPtr leaf(raw, HamtLeafDeleter{inSlab});
+    std::copy(str.begin(), str.end(), static_cast<char *>(memory) + offset);
+
+    nKeys++;
+    keyBytes += str.size();
+    return leaf;
+}
+
+void TopLevelHamtNode::discardKey(const HamtLeaf &leaf) {
+    nKeys--;
+    keyBytes -= leaf.length;
+}
+
+// Add the expected number of nodes with each number of children, in a trie of
+// `n` keys with uniformly distributed hashes, to `counts`, indexed by number
+// of children minus one.
+//
+// The entries at each level split the hashes into buckets, each holding a
+// Poisson-distributed number of keys. A node heads each bucket with at least
+// two keys, and its children are the non-empty buckets below it. Their number
+// is taken to be binomial, which is about right until the nodes are sparse.
+static void expectedNodes(double n, double sign, double counts[MAX_IDX]) {
+    for (double buckets = MAX_IDX;; buckets *= MAX_IDX) {
+        double lambda = n / buckets;
+        double nodes = buckets * (1 - std::exp(-lambda) * (1 + lambda));
+        if (nodes < 1) {
+            return;
+        }
+
+        // Every non-empty bucket on the next level is a child of a node,
+        // except those holding a key that's alone on this level.
+        double children =
+            buckets * (MAX_IDX * -std::expm1(-lambda / MAX_IDX) -
+                       lambda * std::exp(-lambda));
+        double p = children / nodes / MAX_IDX;
+
+        // Dense levels put every node at MAX_IDX children, and the logs below
+        // would make that 0 * -inf. Every node has at least one child.
+        if (p >= 1) {
+            counts[MAX_IDX - 1] += sign * nodes;
+            continue;
+        } else if (p <= 0) {
+            counts[0] += sign * nodes;
+            continue;
+        }
+
+        // P(k children) = C(MAX_IDX, k) p^k (1 - p)^(MAX_IDX - k), computed
+        // in log space since the terms get tiny.
+        for (unsigned k = 1; k <= MAX_IDX; ++k) {
+            double logP = std::lgamma(MAX_IDX + 1.0) - std::lgamma(k + 1.0) -
+                          std::lgamma(MAX_IDX - k + 1.0) + k * std::log(p) +
+                          (MAX_IDX - k) * std::log1p(-p);
+            counts[k - 1] += sign * nodes * std::exp(logP);
+        }
+    }
+}
+
+void TopLevelHamtNode::reserve(size_t n, size_t length) {
+    if (n <= nKeys) {
+        return;
+    }
+    reservedKeys = std::max(reservedKeys, n);
+
+    // The nodes already in the trie will be outgrown, and their memory
+    // reused, so only the difference needs allocating.
+    double counts[MAX_IDX] = {};
+    expectedNodes(n, 1, counts);
+    expectedNodes(nKeys, -1, counts);
+    for (unsigned k = 1; k <= MAX_IDX; ++k) {
+        if (counts[k - 1] >= 1) {
+            pool.reserve(k, std::llround(counts[k - 1]));
+        }
+    }
+
+    if (length == 0 && nKeys != 0) {
+        length = keyBytes / nKeys;
+    }
+    size_t size = leafSize(counted, length);
+    size = (size + alignof(HamtLeaf) - 1) & ~(alignof(HamtLeaf) - 1);
+    leafSlab.reserve((n - nKeys) * size);
+}
+
+const HamtNodePool &TopLevelHamtNode::nodePool() const { return pool; }
+
+const HamtLeaf *TopLevelHamtNode::find(uint64_t hash,
+                                       std::string_view str) const {
     const HamtNodeEntry *entry = &table[hash & FIRST_N_BITS];
     uint64_t lastHash = hash;
     hash >>= BITS_PER_LEVEL;
     unsigned level = 1;
 
     if (entry->isNull())
-        return false;
+        return NULL;
 
     while (true) {
         if (entry->isLeaf()) {
-            auto leaf = entry->getLeaf();
-            return leaf.hash == lastHash && leaf.data == str;
+            auto &leaf = entry->getLeaf();
+            if (leaf.hash != lastHash)
+                return NULL;
+            COUNT(stringComparisons);
+            return leaf.key() == str ? &leaf : NULL;
         } else {
             const HamtNode &node = entry->getChild();
 
             if (!node.containsHash(hash)) {
-                return false;
+                return NULL;
             }
 
             entry = &node.children[node.numberOfHashesAbove(hash) - 1];
@@ -168,8 +723,8 @@ bool TopLevelHamtNode::find(uint64_t hash, const std::string &str) const {
             lastHash = hash;
 
             level++;
-            if (UNLIKELY(level >= LEVELS_PER_HASH) &&
-                (level % LEVELS_PER_HASH) == 0) {
+            COUNT(levelsTraversed);
+            if (UNLIKELY(isBackupLevel(level))) {
                 hash = getNthBackup(str, level / LEVELS_PER_HASH - 1);
             } else {
                 hash >>= BITS_PER_LEVEL;
@@ -179,47 +734,72 @@ bool TopLevelHamtNode::find(uint64_t hash, const std::string &str) const {
     }
 }
 
-void deleteFromNode(HamtNodeEntry *entry, uint64_t hash) {
+void TopLevelHamtNode::deleteFromNode(HamtNodeEntry *entry, uint64_t hash) {
     assert(entry != NULL);
     assert(!entry->isNull());
 
     if (entry->isLeaf()) {
         *entry = HamtNodeEntry();
     } else {
-        std::unique_ptr<HamtNode> node = entry->takeChild();
+        HamtNodePtr node = entry->takeChild();
         assert(node->containsHash(hash));
 
         int nChildren = node->numberOfChildren();
 
         // If we just destructed the node's only child, then delete this node
-        // and be done with it:
+        // and be done with it. The node might head a long chain, so don't
+        // recurse.
         if (nChildren == 1) {
+            freeSubtree(std::move(node), NULL);
             return;
         }
 
         // Otherwise, we'll want to allocate a new, smaller node.
-        std::unique_ptr<HamtNode> newNode(new (nChildren - 1)
-                                              HamtNode(std::move(node), hash));
+        HamtNodePtr newNode(
+            new (pool, nChildren - 1) HamtNode(std::move(node), hash));
 
         *entry = HamtNodeEntry(std::move(newNode));
     }
 }
 
-bool TopLevelHamtNode::erase(uint64_t hash, const std::string &str) {
+bool TopLevelHamtNode::erase(uint64_t hash, std::string_view str,
+                             uint64_t delta, uint64_t *left) {
     HamtNodeEntry *entry = &table[hash & FIRST_N_BITS];
+    uint64_t rootHash = hash;
     HamtNodeEntry *entryToDeleteTo = entry;
     uint64_t hashToDeleteTo = hash >> 6;
+    unsigned levelToDeleteTo = 0;
     unsigned level = 0;
 
+    // To keep the trie canonical, a leaf left as the only child of a node
+    // must be pulled up to replace the chain of single-child nodes above it.
+    // `chainTop` is the highest entry of the chain we're currently in, and
+    // `collapseTo` that of the chain above entryToDeleteTo. Chains are broken
+    // where we switch to a new backup hash, since a leaf can't be moved above
+    // that point without rehashing it.
+    HamtNodeEntry *chainTop = entry;
+    unsigned chainLevel = 0;
+    uint64_t chainHash = hash;
+    HamtNodeEntry *collapseTo = entry;
+    unsigned collapseLevel = 0;
+    uint64_t collapseHash = hash;
+
+    // The nodes passed through on the way down. Those above entryToDeleteTo,
+    // the first `depthToDeleteTo`, lose a leaf if the key is found; the one
+    // at entryToDeleteTo is rebuilt without it.
+    HamtNode *path[PATH_BUFFER];
+    size_t depth = 0;
+    size_t depthToDeleteTo = 0;
+
     if (entry->isNull())
         return false;
 
     while (true) {
         level++;
+        COUNT(levelsTraversed);
 
         uint64_t lastHash = hash;
-        if (UNLIKELY(level >= LEVELS_PER_HASH) &&
-            (level % LEVELS_PER_HASH) == 0) {
+        if (UNLIKELY(isBackupLevel(level))) {
             hash = getNthBackup(str, level / LEVELS_PER_HASH - 1);
         } else {
             hash >>= BITS_PER_LEVEL;
@@ -228,115 +808,1008 @@ bool TopLevelHamtNode::erase(uint64_t hash, const std::string &str) {
         if (entry->isLeaf()) {
             auto &leaf = entry->getLeaf();
 
-            if (lastHash == leaf.hash && leaf.data == str) {
+            if (lastHash != leaf.hash)
+                return false;
+            COUNT(stringComparisons);
+            if (leaf.key() == str) {
+                if (counted) {
+                    auto &countedLeaf = static_cast<HamtCountedLeaf &>(leaf);
+                    if (delta < countedLeaf.count) {
+                        countedLeaf.count -= delta;
+                        if (left != NULL) {
+                            *left = countedLeaf.count;
+                        }
+                        return true;
+                    }
+                }
+                if (left != NULL) {
+                    *left = 0;
+                }
+                discardKey(leaf);
+                resizePath(path, depthToDeleteTo, rootHash, str, -1);
                 deleteFromNode(entryToDeleteTo, hashToDeleteTo);
+                collapse(entryToDeleteTo, levelToDeleteTo, collapseTo,
+                         collapseLevel, collapseHash);
                 return true;
             }
             return false;
         } else {
             auto &node = entry->getChild();
+            bool branches = node.numberOfChildren() > 1;
 
-            if (node.numberOfChildren() > 1) {
+            if (branches) {
                 entryToDeleteTo = entry;
                 hashToDeleteTo = hash;
+                levelToDeleteTo = level - 1;
+                depthToDeleteTo = depth;
+                collapseTo = chainTop;
+                collapseLevel = chainLevel;
+                collapseHash = chainHash;
             }
 
             if (!node.containsHash(hash)) {
                 return false;
             }
 
+            if (depth < PATH_BUFFER) {
+                path[depth] = &node;
+            }
+            depth++;
             entry = &node.children[node.numberOfHashesAbove(hash) - 1];
+
+            if (branches || UNLIKELY(isBackupLevel(level))) {
+                chainTop = entry;
+                chainLevel = level;
+                chainHash = hash;
+            }
         }
     }
 }
 
-//////////////////////////////////////////////////////////////////////////////
-// HamtNodeEntry method definitions.
-//
-
-HamtNodeEntry::HamtNodeEntry(std::unique_ptr<HamtNode> node)
-    : ptr(reinterpret_cast<std::uintptr_t>(node.release())) {}
-
-// Initialize the pointer
-HamtNodeEntry::HamtNodeEntry(std::unique_ptr<HamtLeaf> leaf)
-    : ptr(reinterpret_cast<std::uintptr_t>(leaf.release()) | 1) {}
+void TopLevelHamtNode::collapse(HamtNodeEntry *entry, unsigned level,
+                                HamtNodeEntry *target, unsigned targetLevel,
+                                uint64_t targetHash) {
+    if (entry->isNull() || entry->isLeaf()) {
+        return;
+    }
 
-// Initialize the pointer to NULL.
-HamtNodeEntry::HamtNodeEntry() : ptr(0) {}
+    HamtNode &node = entry->getChild();
+    if (node.numberOfChildren() != 1 || !node.children[0].isLeaf() ||
+        UNLIKELY(isBackupLevel(level + 1))) {
+        return;
+    }
 
-HamtNodeEntry::HamtNodeEntry(HamtNodeEntry &&other) : ptr(other.ptr) {
-    other.ptr = 0;
-}
+    // The leaf's hash has been shifted once per level below the target. Each
+    // level shifted off the index of the entry at that level, which is shared
+    // with the key we just deleted, so we can get the bits back from it.
+    auto leaf = node.children[0].takeLeaf();
+    unsigned shift = BITS_PER_LEVEL * (level + 1 - targetLevel);
+    uint64_t low = targetHash & ((1ULL << shift) - 1);
+    leaf->hash = low | (leaf->hash << shift);
 
-HamtNodeEntry &HamtNodeEntry::operator=(HamtNodeEntry &&other) {
-    this->~HamtNodeEntry();
-    ptr = other.ptr;
-    other.ptr = 0;
-    return *this;
+    *target = HamtNodeEntry(std::move(leaf));
 }
 
-void HamtNodeEntry::release() { ptr = 0; }
-
-bool HamtNodeEntry::isLeaf() const { return ptr & 1; }
+// After some of the children of the node at `entry` have been erased, or
+// have collapsed into leaves, put the node back into canonical form: free it
+// if it's empty, pull a lone leaf up into `entry` as collapse() would, or
+// else reallocate it without its NULL children. `entry` is at the given
+// level, at index `idx` of its node, and `erased` leaves under it are gone.
+static void rebuildNode(HamtNodeEntry *entry, unsigned level, uint64_t idx,
+                        uint64_t erased, HamtNodePool *pool) {
+    HamtNode &node = entry->getChild();
+    int nChildren = node.numberOfChildren();
+    int nLive = 0;
+    HamtNodeEntry *live = NULL;
+    for (int i = 0; i < nChildren; ++i) {
+        if (!node.children[i].isNull()) {
+            nLive++;
+            live = &node.children[i];
+        }
+    }
 
-bool HamtNodeEntry::isNull() const { return ptr == 0; }
+    if (nLive == 0) {
+        *entry = HamtNodeEntry();
+    } else if (nLive == 1 && live->isLeaf() &&
+               LIKELY(!isBackupLevel(level + 1))) {
+        // The leaf's hash lost this level's index when it moved down.
+        auto leaf = live->takeLeaf();
+        leaf->hash = (leaf->hash << BITS_PER_LEVEL) | idx;
+        *entry = HamtNodeEntry(std::move(leaf));
+    } else if (nLive < nChildren) {
+        HamtNodePtr old = entry->takeChild();
+        HamtNode *fresh = pool != NULL
+                              ? new (*pool, nLive) HamtNode(std::move(old))
+                              : new (nLive) HamtNode(std::move(old));
+        *entry = HamtNodeEntry(HamtNodePtr(fresh));
+    }
 
-std::unique_ptr<HamtNode> HamtNodeEntry::takeChild() {
-    assert(!isNull() && !isLeaf());
-    std::unique_ptr<HamtNode> result(reinterpret_cast<HamtNode *>(ptr));
-    ptr = 0;
-    return result;
+    if (!entry->isNull() && !entry->isLeaf()) {
+        entry->getChild().size -= erased;
+    }
 }
 
-HamtNode &HamtNodeEntry::getChild() {
-    assert(!isNull() && !isLeaf());
-    return *reinterpret_cast<HamtNode *>(ptr);
-}
+// Erase the keys `pred` returns true for from the subtree at `root`, the
+// table entry at index `slot`.
+//
+// Nodes are visited in post-order, with an explicit stack so that deep
+// chains of colliding keys can't overflow the real one, and each is rebuilt
+// once all of its children have been swept.
+static void sweepIf(HamtNodeEntry *root, unsigned slot,
+                    const std::function<bool(std::string_view)> &pred,
+                    HamtNodePool *pool,
+                    std::vector<HamtLeafPtr> &doomed) {
+    if (root->isNull()) {
+        return;
+    } else if (root->isLeaf()) {
+        if (pred(root->getLeaf().key())) {
+            doomed.push_back(root->takeLeaf());
+        }
+        return;
+    }
 
-const HamtNode &HamtNodeEntry::getChild() const {
-    assert(!isNull() && !isLeaf());
-    return *reinterpret_cast<HamtNode *>(ptr);
-}
+    // `remaining` has the bits of the children not yet visited, the next of
+    // which is `children[next]`. `erased` counts the leaves erased so far.
+    struct Frame {
+        HamtNodeEntry *entry;
+        unsigned level;
+        uint64_t idx;
+        uint64_t remaining;
+        int next;
+        uint64_t erased;
+    };
+
+    std::vector<Frame> stack;
+    stack.push_back({root, 0, slot, root->getChild().map, 0, 0});
+
+    while (!stack.empty()) {
+        Frame &frame = stack.back();
+        if (frame.remaining == 0) {
+            uint64_t erased = frame.erased;
+            rebuildNode(frame.entry, frame.level, frame.idx, erased, pool);
+            stack.pop_back();
+            if (!stack.empty()) {
+                stack.back().erased += erased;
+            }
+            continue;
+        }
 
-std::unique_ptr<HamtLeaf> HamtNodeEntry::takeLeaf() {
-    std::unique_ptr<HamtLeaf> result(reinterpret_cast<HamtLeaf *>(ptr & (~1)));
-    ptr = 0;
-    return result;
-}
+        // Children are sorted from high to low bits.
+        uint64_t bit = 63 - __builtin_clzll(frame.remaining);
+        frame.remaining &= ~(1ULL << bit);
+        HamtNodeEntry *child = &frame.entry->getChild().children[frame.next++];
 
-HamtLeaf &HamtNodeEntry::getLeaf() {
-    assert(isLeaf());
-    return *reinterpret_cast<HamtLeaf *>(ptr & (~1));
+        if (child->isLeaf()) {
+            if (pred(child->getLeaf().key())) {
+                doomed.push_back(child->takeLeaf());
+                frame.erased++;
+            }
+        } else {
+            unsigned level = frame.level + 1;
+            stack.push_back({child, level, bit, child->getChild().map, 0, 0});
+        }
+    }
 }
 
-const HamtLeaf &HamtNodeEntry::getLeaf() const {
-    assert(isLeaf());
-    return *reinterpret_cast<HamtLeaf *>(ptr & (~1));
+using BatchKey = TopLevelHamtNode::BatchKey;
+
+// If the leaf at `entry` holds one of the keys in [begin, end), whose hashes
+// are at the leaf's level, take it out of the trie, and return whether it
+// did.
+static bool sweepLeaf(HamtNodeEntry *entry, const BatchKey *begin,
+                      const BatchKey *end,
+                      std::vector<HamtLeafPtr> &doomed) {
+    const HamtLeaf &leaf = entry->getLeaf();
+    for (const BatchKey *item = begin; item != end; ++item) {
+        COUNT(stringComparisons);
+        if (item->hash == leaf.hash && item->key == leaf.key()) {
+            doomed.push_back(entry->takeLeaf());
+            return true;
+        }
+    }
+    return false;
 }
 
-HamtNodeEntry::~HamtNodeEntry() {
-    if (isNull()) {
+// Erase the keys in [begin, end), whose hashes are at level 0, from the
+// subtree at `root`, the table entry at index `slot`.
+//
+// Like sweepIf(), but each node is given the keys that belong under it, and
+// only visits the children those keys lead to.
+static void sweepBatch(HamtNodeEntry *root, unsigned slot, BatchKey *begin,
+                       BatchKey *end, HamtNodePool *pool,
+                       std::vector<HamtLeafPtr> &doomed) {
+    if (root->isNull()) {
+        return;
+    } else if (root->isLeaf()) {
+        sweepLeaf(root, begin, end, doomed);
         return;
-    } else if (!isLeaf()) {
-        takeChild();
-    } else {
-        takeLeaf();
     }
-}
 
-//////////////////////////////////////////////////////////////////////////////
-// HamtLeaf method definitions.
-//
+    // The keys in [next, end) are yet to be looked for among the children.
+    // `erased` counts the leaves erased so far.
+    struct Frame {
+        HamtNodeEntry *entry;
+        unsigned level;
+        uint64_t idx;
+        BatchKey *next;
+        BatchKey *end;
+        uint64_t erased;
+    };
+
+    std::vector<Frame> stack;
+
+    // Advance the keys' hashes to the children's level, and group them by
+    // the child they're under.
+    auto push = [&stack](HamtNodeEntry *entry, unsigned level, uint64_t idx,
+                         BatchKey *begin, BatchKey *end) {
+        for (BatchKey *item = begin; item != end; ++item) {
+            item->hash = nextHash(item->hash, level + 1, item->key);
+        }
+        std::sort(begin, end, [](const BatchKey &a, const BatchKey &b) {
+            return (a.hash & FIRST_N_BITS) < (b.hash & FIRST_N_BITS);
+        });
+        stack.push_back({entry, level, idx, begin, end, 0});
+    };
+
+    push(root, 0, slot, begin, end);
+
+    while (!stack.empty()) {
+        Frame &frame = stack.back();
+        if (frame.next == frame.end) {
+            uint64_t erased = frame.erased;
+            rebuildNode(frame.entry, frame.level, frame.idx, erased, pool);
+            stack.pop_back();
+            if (!stack.empty()) {
+                stack.back().erased += erased;
+            }
+            continue;
+        }
 
-HamtLeaf::HamtLeaf(std::string data, uint64_t hash) : data(data), hash(hash) {}
+        uint64_t bit = frame.next->hash & FIRST_N_BITS;
+        BatchKey *groupBegin = frame.next;
+        BatchKey *groupEnd = groupBegin;
+        while (groupEnd != frame.end &&
+               (groupEnd->hash & FIRST_N_BITS) == bit) {
+            groupEnd++;
+        }
+        frame.next = groupEnd;
 
-//////////////////////////////////////////////////////////////////////////////
-// HamtNode method definitions.
-//
+        HamtNode &node = frame.entry->getChild();
+        if (!node.containsHash(bit)) {
+            continue;
+        }
 
-HamtNode::HamtNode(uint64_t hash, HamtNodeEntry entry)
-    : map(1ULL << (hash & FIRST_N_BITS)) {
-    new (&children[0]) HamtNodeEntry(std::move(entry));
+        HamtNodeEntry *child =
+            &node.children[node.numberOfHashesAbove(bit) - 1];
+        if (child->isLeaf()) {
+            frame.erased += sweepLeaf(child, groupBegin, groupEnd, doomed);
+        } else {
+            push(child, frame.level + 1, bit, groupBegin, groupEnd);
+        }
+    }
+}
+
+size_t TopLevelHamtNode::sweepTable(unsigned threads, const Sweep &sweep) {
+    threads = std::clamp<unsigned>(threads, 1, MAX_IDX);
+    std::atomic<size_t> erased(0);
+
+    // The counts of keys aren't thread-safe, so keys are discarded one
+    // entry's worth at a time under a lock, and the leaves freed after, while
+    // they are still likely to be in the cache.
+    std::mutex discarding;
+    auto sweepSlot = [&](unsigned slot, HamtNodePool *pool) {
+        std::vector<HamtLeafPtr> doomed;
+        sweep(slot, pool, doomed);
+        {
+            std::lock_guard<std::mutex> lock(discarding);
+            for (auto &leaf : doomed) {
+                discardKey(*leaf);
+            }
+        }
+        erased += doomed.size();
+    };
+
+    if (threads == 1) {
+        for (unsigned slot = 0; slot < MAX_IDX; ++slot) {
+            sweepSlot(slot, &pool);
+        }
+        return erased;
+    }
+
+    // Threads take one entry at a time, so that a few big subtrees don't
+    // hold up the rest. Nor is the pool thread-safe, so new nodes come
+    // straight from the allocator.
+    std::atomic<unsigned> nextSlot(0);
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < threads; ++t) {
+        workers.emplace_back([&]() {
+            for (unsigned slot = nextSlot++; slot < MAX_IDX;
+                 slot = nextSlot++) {
+                sweepSlot(slot, NULL);
+            }
+        });
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    return erased;
+}
+
+size_t
+TopLevelHamtNode::eraseIf(const std::function<bool(std::string_view)> &pred,
+                          unsigned threads) {
+    return sweepTable(
+        threads, [this, &pred](unsigned slot, HamtNodePool *pool,
+                               std::vector<HamtLeafPtr> &doomed) {
+            sweepIf(&table[slot], slot, pred, pool, doomed);
+        });
+}
+
+size_t TopLevelHamtNode::eraseBatch(std::vector<BatchKey> &batch,
+                                    unsigned threads) {
+    // Group the keys by table entry.
+    std::sort(batch.begin(), batch.end(),
+              [](const BatchKey &a, const BatchKey &b) {
+                  return (a.hash & FIRST_N_BITS) < (b.hash & FIRST_N_BITS);
+              });
+
+    size_t starts[MAX_IDX + 1] = {};
+    for (const auto &item : batch) {
+        starts[(item.hash & FIRST_N_BITS) + 1]++;
+    }
+    for (unsigned slot = 0; slot < MAX_IDX; ++slot) {
+        starts[slot + 1] += starts[slot];
+    }
+
+    return sweepTable(
+        threads, [&](unsigned slot, HamtNodePool *pool,
+                     std::vector<HamtLeafPtr> &doomed) {
+            if (starts[slot] != starts[slot + 1]) {
+                sweepBatch(&table[slot], slot, batch.data() + starts[slot],
+                           batch.data() + starts[slot + 1], pool, doomed);
+            }
+        });
+}
+
+// A copy of `entry`, pointing to the same node or leaf, for apply() to build
+// new nodes with. Only one of the two may go on to free it.
+static HamtNodeEntry alias(const HamtNodeEntry &entry) {
+    HamtNodeEntry result;
+    std::memcpy(&result, &entry, sizeof(entry));
+    return result;
+}
+
+// Start loading the node or leaf at `entry`.
+static void prefetchEntry(const HamtNodeEntry &entry) {
+    if (entry.isLeaf()) {
+        __builtin_prefetch(&entry.getLeaf());
+    } else if (!entry.isNull()) {
+        __builtin_prefetch(&entry.getChild());
+    }
+}
+
+// Whether two entries point to the same thing.
+static bool sameEntry(const HamtNodeEntry &a, const HamtNodeEntry &b) {
+    return std::memcmp(&a, &b, sizeof(a)) == 0;
+}
+
+struct TopLevelHamtNode::Transaction {
+    // An entry of the new trie, and the number of leaves under it. Until the
+    // transaction commits, what it points to belongs to the lists below or
+    // to the old trie, so it never frees it. A leaf may still have the hash
+    // for its old level, so the hash for the entry's level is kept alongside;
+    // for a node, `hash` is unused.
+    struct Result {
+        Result(HamtNodeEntry entry, uint64_t hash, uint64_t size)
+            : entry(std::move(entry)), hash(hash), size(size) {}
+        Result(Result &&other) = default;
+        Result &operator=(Result &&other) = delete;
+        ~Result() { entry.release(); }
+
+        HamtNodeEntry entry;
+        uint64_t hash;
+        uint64_t size;
+    };
+
+    // The entries of old nodes (or of the table) to overwrite, with their
+    // new contents.
+    std::vector<std::pair<HamtNodeEntry *, Result>> patches;
+
+    // Old nodes that keep their children, and their new sizes.
+    std::vector<std::pair<HamtNode *, uint64_t>> resized;
+
+    // The nodes and leaves allocated for the new trie.
+    std::vector<HamtNode *> nodes;
+    std::vector<HamtLeafPtr> leaves;
+
+    // The entries of the old trie to free, each node after its children.
+    std::vector<HamtNodeEntry *> retired;
+
+    // The leaves whose hashes change with their level, and the new hashes.
+    std::vector<std::pair<HamtLeaf *, uint64_t>> rehashed;
+};
+
+void TopLevelHamtNode::prepare(unsigned slot, BatchChange *begin,
+                               BatchChange *end, Transaction &txn) {
+    using Result = Transaction::Result;
+
+    // A node being rebuilt in place of `old`, or built from scratch if that's
+    // NULL. The changes in [next, end), whose hashes are at the children's
+    // level, are yet to be handed to the children. The new entries for the
+    // children that changed so far are in `built` from `firstBuilt` on, from
+    // low to high bits. When building from scratch, the changes are the keys
+    // to build with, in `scratch`.
+    //
+    // Nodes are visited in post-order, with an explicit stack so that deep
+    // chains of colliding keys can't overflow the real one.
+    struct Frame {
+        HamtNodeEntry *old;
+        unsigned level;
+        uint64_t idx;
+        BatchChange *next;
+        BatchChange *end;
+        size_t firstBuilt;
+        std::vector<BatchChange> scratch;
+    };
+
+    std::vector<Frame> stack;
+    std::vector<std::pair<uint64_t, Result>> built;
+
+    // Note the hash a leaf needs at its new level.
+    auto settle = [&txn](const HamtNodeEntry &entry, uint64_t hash) {
+        if (entry.isLeaf() && entry.getLeaf().hash != hash) {
+            txn.rehashed.push_back(
+                {const_cast<HamtLeaf *>(&entry.getLeaf()), hash});
+        }
+    };
+
+    // Overwrite `entry`, in a node that stays, with the new one when the
+    // transaction commits.
+    auto patch = [&](HamtNodeEntry *entry, Result &result) {
+        if (!sameEntry(*entry, result.entry)) {
+            settle(result.entry, result.hash);
+            txn.patches.emplace_back(
+                entry, Result(alias(result.entry), result.hash, result.size));
+        }
+    };
+
+    // Hand the new entry at index `idx` to the node being rebuilt above it,
+    // or to the table.
+    auto deliver = [&](uint64_t idx, Result result) {
+        if (stack.empty()) {
+            patch(&table[slot], result);
+        } else {
+            built.emplace_back(idx, std::move(result));
+        }
+    };
+
+    // Advance the changes' hashes to `level`, and group them by the entry
+    // they're under.
+    auto group = [](BatchChange *begin, BatchChange *end, unsigned level) {
+        for (BatchChange *item = begin; item != end; ++item) {
+            item->hash = nextHash(item->hash, level, item->key);
+        }
+        std::sort(begin, end, [](const BatchChange &a, const BatchChange &b) {
+            return (a.hash & FIRST_N_BITS) < (b.hash & FIRST_N_BITS);
+        });
+    };
+
+    // Work out what becomes of `old`, at the given level and index, with the
+    // changes in [begin, end), whose hashes are at that level. `old` may be
+    // NULL, or point to a NULL entry. A node gets a frame of its own; a leaf,
+    // or nothing, is dealt with at once unless it grows into a subtree.
+    auto visit = [&](HamtNodeEntry *old, unsigned level, uint64_t idx,
+                     BatchChange *begin, BatchChange *end) {
+        if (old != NULL && old->isNull()) {
+            old = NULL;
+        }
+        if (old != NULL && !old->isLeaf()) {
+            group(begin, end, level + 1);
+
+            // The children the changes lead to are visited in turn, so start
+            // loading them all now.
+            const HamtNode &node = old->getChild();
+            for (BatchChange *item = begin; item != end; ++item) {
+                if (node.containsHash(item->hash)) {
+                    int idx = node.numberOfHashesAbove(item->hash) - 1;
+                    prefetchEntry(node.children[idx]);
+                }
+            }
+
+            stack.push_back({old, level, idx, begin, end, built.size(), {}});
+            return;
+        }
+
+        // Count the keys to go here besides the old leaf's, and see whether
+        // that one stays.
+        HamtLeaf *leaf = old != NULL ? &old->getLeaf() : NULL;
+        BatchChange *same = NULL;
+        BatchChange *last = NULL;
+        size_t n = 0;
+        for (BatchChange *item = begin; item != end; ++item) {
+            if (leaf != NULL && item->hash == leaf->hash) {
+                COUNT(stringComparisons);
+                if (item->key == leaf->key()) {
+                    same = item;
+                    continue;
+                }
+            }
+            if (item->insert) {
+                last = item;
+                n++;
+            }
+        }
+        bool kept = leaf != NULL && (same == NULL || same->insert);
+
+        if (n == 0) {
+            if (leaf != NULL && !kept) {
+                txn.retired.push_back(old);
+                deliver(idx, Result(HamtNodeEntry(), 0, 0));
+            }
+            return;
+        }
+        if (leaf != NULL && !kept) {
+            txn.retired.push_back(old);
+        }
+
+        if (n == 1 && !kept) {
+            if (last->leaf != NULL) {
+                deliver(idx, Result(alias(*last->leaf), last->hash, 1));
+                return;
+            }
+            txn.leaves.emplace_back();
+            txn.leaves.back() = newLeaf(last->hash, last->key);
+            HamtLeafPtr &fresh = txn.leaves.back();
+            deliver(idx, Result(HamtNodeEntry(HamtLeafPtr(
+                                    fresh.get(), fresh.get_deleter())),
+                                last->hash, 1));
+            return;
+        }
+
+        // Two or more keys go here, so build a subtree for them, moving the
+        // old leaf down into it.
+        std::vector<BatchChange> scratch;
+        if (kept) {
+            scratch.push_back({leaf->key(), leaf->hash, true, old});
+        }
+        for (BatchChange *item = begin; item != end; ++item) {
+            if (item->insert && item != same) {
+                scratch.push_back(*item);
+            }
+        }
+        stack.push_back(
+            {NULL, level, idx, NULL, NULL, built.size(), std::move(scratch)});
+        Frame &frame = stack.back();
+        frame.next = frame.scratch.data();
+        frame.end = frame.next + frame.scratch.size();
+        group(frame.next, frame.end, level + 1);
+    };
+
+    // Merge the new entries for the changed children with the old node's
+    // other children, into canonical form as rebuildNode() would leave them.
+    // A node that keeps the same children is patched in place; otherwise a
+    // new one is built, once, with the final set of children. Sizes are
+    // worked out from the changed children alone, so that the others, and
+    // their subtrees, aren't touched.
+    auto rebuild = [&](Frame &frame) {
+        HamtNode *old = frame.old != NULL ? &frame.old->getChild() : NULL;
+        auto *changed = built.data() + frame.firstBuilt;
+        size_t nChanged = built.size() - frame.firstBuilt;
+
+        uint64_t oldMap = old != NULL ? old->map : 0;
+        uint64_t map = oldMap;
+        uint64_t size = old != NULL ? old->size : 0;
+        bool inPlace = old != NULL;
+        for (size_t i = 0; i < nChanged; ++i) {
+            uint64_t bit = changed[i].first;
+            const Result &result = changed[i].second;
+            if (old != NULL && old->containsHash(bit)) {
+                size -= old->children[old->numberOfHashesAbove(bit) - 1].size();
+            } else {
+                inPlace = false;
+            }
+            size += result.size;
+            if (result.entry.isNull()) {
+                map &= ~(1ULL << bit);
+                inPlace = false;
+            } else {
+                map |= 1ULL << bit;
+            }
+        }
+
+        int n = __builtin_popcountll(map);
+        if (n == 0) {
+            if (old != NULL) {
+                txn.retired.push_back(frame.old);
+            }
+            return Result(HamtNodeEntry(), 0, 0);
+        } else if (inPlace && n > 1) {
+            for (size_t i = 0; i < nChanged; ++i) {
+                uint64_t bit = changed[i].first;
+                patch(&old->children[old->numberOfHashesAbove(bit) - 1],
+                      changed[i].second);
+            }
+            txn.resized.push_back({old, size});
+            return Result(alias(*frame.old), 0, size);
+        }
+
+        // The entries to copy into the node, from high to low bits, with the
+        // results for the changed ones (NULL for the others).
+        const HamtNodeEntry *from[MAX_IDX];
+        const Result *results[MAX_IDX];
+        int k = 0;
+        int next = 0;
+        size_t remainingChanged = nChanged;
+        for (uint64_t remaining = map | oldMap; remaining != 0;) {
+            uint64_t bit = 63 - __builtin_clzll(remaining);
+            remaining &= ~(1ULL << bit);
+            const HamtNodeEntry *oldChild = NULL;
+            if ((oldMap >> bit) & 1) {
+                oldChild = &old->children[next++];
+            }
+            const Result *result = NULL;
+            if (remainingChanged > 0 &&
+                changed[remainingChanged - 1].first == bit) {
+                result = &changed[--remainingChanged].second;
+            }
+
+            if (result == NULL) {
+                from[k] = oldChild;
+            } else if (!result->entry.isNull()) {
+                from[k] = &result->entry;
+            } else {
+                continue;
+            }
+            results[k++] = result;
+        }
+
+        if (n == 1 && from[0]->isLeaf() &&
+            LIKELY(!isBackupLevel(frame.level + 1))) {
+            // The leaf's hash lost this level's index when it moved down.
+            uint64_t hash = results[0] != NULL ? results[0]->hash
+                                               : from[0]->getLeaf().hash;
+            if (old != NULL) {
+                txn.retired.push_back(frame.old);
+            }
+            return Result(alias(*from[0]),
+                          (hash << BITS_PER_LEVEL) | frame.idx, 1);
+        } else if (inPlace) {
+            patch(&old->children[0], changed[0].second);
+            txn.resized.push_back({old, size});
+            return Result(alias(*frame.old), 0, size);
+        }
+
+        if (old != NULL) {
+            txn.retired.push_back(frame.old);
+        }
+        for (int i = 0; i < n; ++i) {
+            if (results[i] != NULL) {
+                settle(results[i]->entry, results[i]->hash);
+            }
+        }
+
+        // Get the memory before copying the entries in, so that nothing is
+        // left owning them if that fails.
+        txn.nodes.push_back(NULL);
+        void *memory = pool.allocate(n);
+        HamtNode *node = ::new (memory) HamtNode(map, size, from);
+        txn.nodes.back() = node;
+        return Result(HamtNodeEntry(HamtNodePtr(node)), 0, size);
+    };
+
+    visit(&table[slot], 0, slot, begin, end);
+
+    while (!stack.empty()) {
+        Frame &frame = stack.back();
+        if (frame.next != frame.end) {
+            uint64_t bit = frame.next->hash & FIRST_N_BITS;
+            BatchChange *groupBegin = frame.next;
+            BatchChange *groupEnd = groupBegin;
+            while (groupEnd != frame.end &&
+                   (groupEnd->hash & FIRST_N_BITS) == bit) {
+                groupEnd++;
+            }
+            frame.next = groupEnd;
+
+            HamtNodeEntry *child = NULL;
+            if (frame.old != NULL) {
+                HamtNode &node = frame.old->getChild();
+                if (node.containsHash(bit)) {
+                    child = &node.children[node.numberOfHashesAbove(bit) - 1];
+                }
+            }
+            visit(child, frame.level + 1, bit, groupBegin, groupEnd);
+            continue;
+        }
+
+        // If nothing under the node changed, it stays as it is.
+        size_t firstBuilt = frame.firstBuilt;
+        if (firstBuilt == built.size()) {
+            stack.pop_back();
+            continue;
+        }
+
+        uint64_t idx = frame.idx;
+        Result result = rebuild(frame);
+        stack.pop_back();
+        while (built.size() > firstBuilt) {
+            built.pop_back();
+        }
+        deliver(idx, std::move(result));
+    }
+}
+
+void TopLevelHamtNode::commit(Transaction &txn) {
+    for (HamtNodeEntry *entry : txn.retired) {
+        if (entry->isLeaf()) {
+            discardKey(entry->getLeaf());
+            entry->takeLeaf();
+        } else {
+            // Each child is in the new trie by now, or has been freed.
+            entry->getChild().forgetChildren();
+            entry->takeChild();
+        }
+    }
+
+    for (auto &[node, size] : txn.resized) {
+        node->size = size;
+    }
+    for (auto &[leaf, hash] : txn.rehashed) {
+        leaf->hash = hash;
+    }
+    for (auto &leaf : txn.leaves) {
+        leaf.release();
+    }
+
+    // The entries being overwritten have been freed, or are still in use
+    // further down.
+    for (auto &[entry, result] : txn.patches) {
+        entry->release();
+        *entry = std::move(result.entry);
+    }
+}
+
+void TopLevelHamtNode::rollback(Transaction &txn) {
+    // The new nodes share children with the old trie, so free them one by
+    // one rather than as subtrees.
+    for (HamtNode *node : txn.nodes) {
+        if (node != NULL) {
+            int nChildren = node->numberOfChildren();
+            node->forgetChildren();
+            node->~HamtNode();
+            pool.release(node, nChildren);
+        }
+    }
+    for (auto &leaf : txn.leaves) {
+        if (leaf != NULL) {
+            discardKey(*leaf);
+        }
+    }
+    txn.leaves.clear();
+}
+
+void TopLevelHamtNode::apply(std::vector<BatchChange> &batch) {
+    // Group the changes by table entry, with those to the same key together,
+    // in the order they were made.
+    std::stable_sort(batch.begin(), batch.end(),
+                     [](const BatchChange &a, const BatchChange &b) {
+                         uint64_t idxA = a.hash & FIRST_N_BITS;
+                         uint64_t idxB = b.hash & FIRST_N_BITS;
+                         if (idxA != idxB) {
+                             return idxA < idxB;
+                         } else if (a.hash != b.hash) {
+                             return a.hash < b.hash;
+                         }
+                         return a.key < b.key;
+                     });
+
+    // Only the last change to each key counts.
+    size_t n = 0;
+    for (size_t i = 0; i < batch.size(); ++i) {
+        if (i + 1 < batch.size() && batch[i + 1].hash == batch[i].hash &&
+            batch[i + 1].key == batch[i].key) {
+            continue;
+        }
+        batch[n++] = batch[i];
+    }
+    batch.erase(batch.begin() + n, batch.end());
+
+    Transaction txn;
+    try {
+        size_t begin = 0;
+        while (begin < batch.size()) {
+            unsigned slot = batch[begin].hash & FIRST_N_BITS;
+            size_t end = begin;
+            while (end < batch.size() &&
+                   (batch[end].hash & FIRST_N_BITS) == slot) {
+                end++;
+            }
+            prepare(slot, batch.data() + begin, batch.data() + end, txn);
+            begin = end;
+        }
+    } catch (...) {
+        rollback(txn);
+        throw;
+    }
+    commit(txn);
+}
+
+HamtShape TopLevelHamtNode::shape() const {
+    HamtShape result;
+    std::vector<std::pair<const HamtNodeEntry *, std::uint64_t>> stack;
+
+    for (const auto &entry : table) {
+        stack.emplace_back(&entry, 0);
+    }
+
+    while (!stack.empty()) {
+        auto [entry, depth] = stack.back();
+        stack.pop_back();
+
+        if (entry->isNull()) {
+            continue;
+        } else if (entry->isLeaf()) {
+            result.leaves++;
+            result.totalDepth += depth;
+            result.maxDepth = std::max(result.maxDepth, depth);
+        } else {
+            const HamtNode &node = entry->getChild();
+            int nChildren = node.numberOfChildren();
+            result.nodes++;
+            result.singleChildNodes += nChildren == 1;
+            for (int i = 0; i < nChildren; ++i) {
+                stack.emplace_back(&node.children[i], depth + 1);
+            }
+        }
+    }
+
+    return result;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// HamtNodeEntry method definitions.
+//
+
+HamtNodeEntry::HamtNodeEntry(HamtNodePtr node)
+    : ptr(reinterpret_cast<std::uintptr_t>(node.get()) |
+          (node.get_deleter().inArena ? 2 : 0)) {
+    node.release();
+}
+
+// Initialize the pointer
+HamtNodeEntry::HamtNodeEntry(HamtLeafPtr leaf)
+    : ptr(reinterpret_cast<std::uintptr_t>(leaf.get()) | 1 |
+          (leaf.get_deleter().inSlab ? 2 : 0)) {
+    leaf.release();
+}
+
+// Initialize the pointer to NULL.
+HamtNodeEntry::HamtNodeEntry() : ptr(0) {}
+
+HamtNodeEntry::HamtNodeEntry(HamtNodeEntry &&other) : ptr(other.ptr) {
+    other.ptr = 0;
+}
+
+HamtNodeEntry &HamtNodeEntry::operator=(HamtNodeEntry &&other) {
+    this->~HamtNodeEntry();
+    ptr = other.ptr;
+    other.ptr = 0;
+    return *this;
+}
+
+void HamtNodeEntry::release() { ptr = 0; }
+
+bool HamtNodeEntry::isLeaf() const { return ptr & 1; }
+
+bool HamtNodeEntry::isNull() const { return ptr == 0; }
+
+uint64_t HamtNodeEntry::size() const {
+    if (isNull()) {
+        return 0;
+    } else if (isLeaf()) {
+        return 1;
+    }
+    return getChild().size;
+}
+
+HamtNodePtr HamtNodeEntry::takeChild() {
+    assert(!isNull() && !isLeaf());
+    HamtNodePtr result(reinterpret_cast<HamtNode *>(ptr & (~2)),
+                       HamtNodeDeleter{(ptr & 2) != 0});
+    ptr = 0;
+    return result;
+}
+
+HamtNode &HamtNodeEntry::getChild() {
+    assert(!isNull() && !isLeaf());
+    return *reinterpret_cast<HamtNode *>(ptr & (~2));
+}
+
+const HamtNode &HamtNodeEntry::getChild() const {
+    assert(!isNull() && !isLeaf());
+    return *reinterpret_cast<HamtNode *>(ptr & (~2));
+}
+
+HamtLeafPtr HamtNodeEntry::takeLeaf() {
+    HamtLeafPtr result(reinterpret_cast<HamtLeaf *>(ptr & (~3)),
+                       HamtLeafDeleter{(ptr & 2) != 0});
+    ptr = 0;
+    return result;
+}
+
+HamtLeaf &HamtNodeEntry::getLeaf() {
+    assert(isLeaf());
+    return *reinterpret_cast<HamtLeaf *>(ptr & (~3));
+}
+
+const HamtLeaf &HamtNodeEntry::getLeaf() const {
+    assert(isLeaf());
+    return *reinterpret_cast<HamtLeaf *>(ptr & (~3));
+}
+
+HamtNodeEntry::~HamtNodeEntry() {
+    if (isNull()) {
+        return;
+    } else if (!isLeaf()) {
+        takeChild();
+    } else {
+        takeLeaf();
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// HamtLeaf method definitions.
+//
+
+HamtLeaf::HamtLeaf(uint64_t hash, uint32_t length, uint32_t offset)
+    : hash(hash), length(length), offset(offset) {}
+
+HamtCountedLeaf::HamtCountedLeaf(uint64_t hash, uint32_t length,
+                                 uint32_t offset)
+    : HamtLeaf(hash, length, offset), count(0) {}
+
+std::string_view HamtLeaf::key() const {
+    return std::string_view(reinterpret_cast<const char *>(this) + offset,
+                            length);
+}
+
+void HamtLeafDeleter::operator()(HamtLeaf *leaf) const {
+    leaf->~HamtLeaf();
+    if (!inSlab) {
+        ::operator delete(leaf);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// HamtHandle method definitions.
+//
+
+HamtHandle::HamtHandle() : leaf(NULL) {}
+
+HamtHandle::HamtHandle(const HamtLeaf *leaf) : leaf(leaf) {}
+
+HamtHandle::operator bool() const { return leaf != NULL; }
+
+std::string_view HamtHandle::str() const {
+    assert(leaf != NULL);
+    return leaf->key();
+}
+
+bool HamtHandle::operator==(const HamtHandle &other) const {
+    return leaf == other.leaf;
+}
+
+bool HamtHandle::operator!=(const HamtHandle &other) const {
+    return leaf != other.leaf;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// HamtNode method definitions.
+//
+
+HamtNode::HamtNode(uint64_t hash, HamtNodeEntry entry)
+    : map(1ULL << (hash & FIRST_N_BITS)), size(entry.size()) {
+    new (&children[0]) HamtNodeEntry(std::move(entry));
 }
 
 HamtNode::HamtNode(uint64_t hash1, HamtNodeEntry entry1, uint64_t hash2,
@@ -345,6 +1818,7 @@ HamtNode::HamtNode(uint64_t hash1, HamtNodeEntry entry1, uint64_t hash2,
     auto key2 = hash2 & FIRST_N_BITS;
 
     map = (1ULL << key1) | (1ULL << key2);
+    size = entry1.size() + entry2.size();
 
     HamtNodeEntry firstEntry;
     HamtNodeEntry secondEntry;
@@ -358,12 +1832,14 @@ HamtNode::HamtNode(uint64_t hash1, HamtNodeEntry entry1, uint64_t hash2,
     }
 }
 
-HamtNode::HamtNode(std::unique_ptr<HamtNode> node, uint64_t hash) {
+HamtNode::HamtNode(HamtNodePtr node, uint64_t hash) {
+    COUNT(nodeReallocations);
     map = node->map;
     node->map = 0;
     unmarkHash(hash);
     int idx = numberOfHashesAbove(hash);
     size_t nChildren = numberOfChildren();
+    size = node->size - node->children[idx].size();
 
     // As with the corresponding constructor for insert, measurements show that
     // this is actually substantially faster than just moving the children
@@ -374,8 +1850,14 @@ HamtNode::HamtNode(std::unique_ptr<HamtNode> node, uint64_t hash) {
     std::memcpy(&children[0], &node->children[0], firstHalfBytes);
     std::memset(&node->children[0], 0, firstHalfBytes);
 
-    // Delete the actual child we're looking at.
-    node->children[idx] = HamtNodeEntry();
+    // Delete the actual child we're looking at. It may head a long chain, so
+    // don't recurse.
+    HamtNodeEntry &removed = node->children[idx];
+    if (!removed.isNull() && !removed.isLeaf()) {
+        freeSubtree(removed.takeChild(), NULL);
+    } else {
+        removed = HamtNodeEntry();
+    }
 
     // memcpy and then zero out the bytes after the child we're deleting.
     size_t sndHalfBytes = (nChildren - idx) * sizeof(HamtNodeEntry);
@@ -383,11 +1865,13 @@ HamtNode::HamtNode(std::unique_ptr<HamtNode> node, uint64_t hash) {
     std::memset(&node->children[0], 0, sndHalfBytes);
 }
 
-HamtNode::HamtNode(std::unique_ptr<HamtNode> node, HamtNodeEntry entry,
+HamtNode::HamtNode(HamtNodePtr node, HamtNodeEntry entry,
                    uint64_t hash) {
+    COUNT(nodeReallocations);
     uint64_t nChildren = node->numberOfChildren();
     map = node->map;
     node->map = 0;
+    size = node->size + entry.size();
     assert(!containsHash(hash));
     size_t idx = numberOfHashesAbove(hash);
     markHash(hash);
@@ -401,6 +1885,35 @@ HamtNode::HamtNode(std::unique_ptr<HamtNode> node, HamtNodeEntry entry,
     std::memset(&node->children[0], 0, sizeof(HamtNodeEntry) * nChildren);
 }
 
+HamtNode::HamtNode(HamtNodePtr node) : map(0), size(node->size) {
+    COUNT(nodeReallocations);
+    int nChildren = node->numberOfChildren();
+    uint64_t remaining = node->map;
+    int live = 0;
+
+    // Children are sorted from high to low bits.
+    for (int i = 0; i < nChildren; ++i) {
+        uint64_t bit = 63 - __builtin_clzll(remaining);
+        remaining &= ~(1ULL << bit);
+        if (!node->children[i].isNull()) {
+            map |= 1ULL << bit;
+            new (&children[live++]) HamtNodeEntry(std::move(node->children[i]));
+        }
+    }
+
+    node->map = 0;
+}
+
+HamtNode::HamtNode(uint64_t map, uint64_t size,
+                   const HamtNodeEntry *const *entries)
+    : map(map), size(size) {
+    COUNT(nodeReallocations);
+    int nChildren = numberOfChildren();
+    for (int i = 0; i < nChildren; ++i) {
+        std::memcpy(&children[i], entries[i], sizeof(HamtNodeEntry));
+    }
+}
+
 int HamtNode::numberOfChildren() const {
     return __builtin_popcountll((unsigned long long)map);
 }
@@ -422,6 +1935,14 @@ void HamtNode::unmarkHash(uint64_t hash) {
     map &= ~(1ULL << (hash & FIRST_N_BITS));
 }
 
+void HamtNode::forgetChildren() {
+    int nChildren = numberOfChildren();
+    for (int i = 0; i < nChildren; ++i) {
+        children[i].release();
+    }
+    map = 0;
+}
+
 HamtNode::~HamtNode() {
     int nChildren = numberOfChildren();
     for (int i = 0; i < nChildren; ++i) {
@@ -429,31 +1950,666 @@ HamtNode::~HamtNode() {
     }
 }
 
+size_t HamtNode::allocationSize(int nChildren) {
+    return sizeof(HamtNode) + (nChildren - 1) * sizeof(HamtNodeEntry);
+}
+
 void *HamtNode::operator new(size_t, int nChildren) {
-    return malloc(sizeof(HamtNode) + (nChildren - 1) * sizeof(HamtNodeEntry));
+    void *memory = malloc(allocationSize(nChildren));
+    if (memory == NULL) {
+        throw std::bad_alloc();
+    }
+    return memory;
+}
+
+void *HamtNode::operator new(size_t, HamtNodePool &pool, int nChildren) {
+    return pool.allocate(nChildren);
 }
 
 void HamtNode::operator delete(void *p) { free(p); }
 
+void HamtNodeDeleter::operator()(HamtNode *node) const {
+    if (inArena) {
+        node->~HamtNode();
+    } else {
+        delete node;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// HamtNodePool method definitions.
+//
+
+HamtNodePool::HamtNodePool(HamtNodePool &&other) {
+    std::memcpy(freeLists, other.freeLists, sizeof(freeLists));
+    std::memset(other.freeLists, 0, sizeof(freeLists));
+}
+
+HamtNodePool &HamtNodePool::operator=(HamtNodePool &&other) {
+    clear();
+    std::memcpy(freeLists, other.freeLists, sizeof(freeLists));
+    std::memset(other.freeLists, 0, sizeof(freeLists));
+    return *this;
+}
+
+HamtNodePool::~HamtNodePool() { clear(); }
+
+void HamtNodePool::clear() {
+    for (auto &head : freeLists) {
+        while (head != NULL) {
+            void *next = *static_cast<void **>(head);
+            free(head);
+            head = next;
+        }
+    }
+}
+
+void *HamtNodePool::allocate(int nChildren) {
+    void *&head = freeLists[nChildren - 1];
+    if (head == NULL) {
+        void *memory = malloc(HamtNode::allocationSize(nChildren));
+        if (memory == NULL) {
+            throw std::bad_alloc();
+        }
+        return memory;
+    }
+    void *result = head;
+    head = *static_cast<void **>(head);
+    return result;
+}
+
+void HamtNodePool::release(void *p, int nChildren) {
+    void *&head = freeLists[nChildren - 1];
+    *static_cast<void **>(p) = head;
+    head = p;
+}
+
+size_t HamtNodePool::available(int nChildren) const {
+    size_t count = 0;
+    for (void *p = freeLists[nChildren - 1]; p != NULL;
+         p = *static_cast<void **>(p)) {
+        count++;
+    }
+    return count;
+}
+
+void HamtNodePool::reserve(int nChildren, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        void *p = malloc(HamtNode::allocationSize(nChildren));
+        if (p == NULL) {
+            throw std::bad_alloc();
+        }
+        release(p, nChildren);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// HamtNodeArena method definitions.
+//
+
+// Chunks are allocated at least this big.
+static constexpr size_t ARENA_CHUNK_SIZE = 1 << 20;
+
+// Chunks start on a cache line.
+static constexpr size_t CACHE_LINE_SIZE = 64;
+
+HamtNodeArena::HamtNodeArena(HamtNodeArena &&other)
+    : chunks(std::move(other.chunks)), used(other.used) {
+    other.chunks.clear();
+    other.used = 0;
+}
+
+HamtNodeArena &HamtNodeArena::operator=(HamtNodeArena &&other) {
+    clear();
+    chunks = std::move(other.chunks);
+    used = other.used;
+    other.chunks.clear();
+    other.used = 0;
+    return *this;
+}
+
+HamtNodeArena::~HamtNodeArena() { clear(); }
+
+void HamtNodeArena::clear() {
+    for (auto &chunk : chunks) {
+        free(chunk.memory);
+    }
+    chunks.clear();
+    used = 0;
+}
+
+void HamtNodeArena::reserve(size_t bytes) {
+    if (chunks.empty() || chunks.back().size - used < bytes) {
+        addChunk(bytes);
+    }
+}
+
+void *HamtNodeArena::allocate(int nChildren) {
+    size_t bytes = HamtNode::allocationSize(nChildren);
+    if (chunks.empty() || chunks.back().size - used < bytes) {
+        addChunk(std::max(bytes, ARENA_CHUNK_SIZE));
+    }
+    void *result = chunks.back().memory + used;
+    used += bytes;
+    return result;
+}
+
+size_t HamtNodeArena::capacity() const {
+    size_t result = 0;
+    for (const auto &chunk : chunks) {
+        result += chunk.size;
+    }
+    return result;
+}
+
+void HamtNodeArena::addChunk(size_t bytes) {
+    // aligned_alloc needs a multiple of the alignment.
+    bytes = (bytes + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1);
+    char *memory = static_cast<char *>(aligned_alloc(CACHE_LINE_SIZE, bytes));
+    if (memory == NULL) {
+        throw std::bad_alloc();
+    }
+    chunks.push_back({memory, bytes});
+    used = 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// HamtLeafSlab method definitions.
+//
+
+HamtLeafSlab::HamtLeafSlab(HamtLeafSlab &&other)
+    : blocks(std::move(other.blocks)), current(other.current),
+      used(other.used) {
+    other.blocks.clear();
+    other.current = 0;
+    other.used = 0;
+}
+
+HamtLeafSlab &HamtLeafSlab::operator=(HamtLeafSlab &&other) {
+    clear();
+    std::swap(blocks, other.blocks);
+    std::swap(current, other.current);
+    std::swap(used, other.used);
+    return *this;
+}
+
+HamtLeafSlab::~HamtLeafSlab() { clear(); }
+
+void HamtLeafSlab::clear() {
+    for (auto &block : blocks) {
+        free(block.memory);
+    }
+    blocks.clear();
+    current = 0;
+    used = 0;
+}
+
+void HamtLeafSlab::rewind() {
+    current = 0;
+    used = 0;
+}
+
+void HamtLeafSlab::reserve(size_t bytes) {
+    size_t available = 0;
+    for (size_t i = current; i < blocks.size(); ++i) {
+        available += blocks[i].size;
+    }
+    if (current < blocks.size()) {
+        available -= used;
+    }
+    if (available >= bytes) {
+        return;
+    }
+
+    size_t size = bytes - available;
+    auto memory = static_cast<char *>(malloc(size));
+    if (memory == NULL) {
+        throw std::bad_alloc();
+    }
+    try {
+        blocks.push_back({memory, size});
+    } catch (...) {
+        free(memory);
+        throw;
+    }
+}
+
+void *HamtLeafSlab::allocate(size_t bytes) {
+    bytes = (bytes + alignof(HamtLeaf) - 1) & ~(alignof(HamtLeaf) - 1);
+    if (current == blocks.size()) {
+        return NULL;
+    } else if (blocks[current].size - used < bytes) {
+        // Leave the rest of this block unused if the leaf fits in the next,
+        // but don't skip blocks for one that fits nowhere.
+        if (current + 1 == blocks.size() || blocks[current + 1].size < bytes) {
+            return NULL;
+        }
+        current++;
+        used = 0;
+    }
+
+    void *result = blocks[current].memory + used;
+    used += bytes;
+    return result;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// FrozenHamt method definitions.
+//
+
+// Get memory for `n` frozen nodes, starting on a cache line.
+static FrozenHamtNode *allocateFrozenNodes(size_t n) {
+    size_t bytes = n * sizeof(FrozenHamtNode);
+    bytes = (bytes + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1);
+    void *memory = aligned_alloc(CACHE_LINE_SIZE, bytes);
+    if (memory == NULL) {
+        throw std::bad_alloc();
+    }
+    return static_cast<FrozenHamtNode *>(memory);
+}
+
+FrozenHamt TopLevelHamtNode::freeze() const {
+    HamtShape counts = shape();
+    assert(counts.nodes < UINT32_MAX && counts.leaves < UINT32_MAX);
+
+    FrozenHamt result;
+    result.nodes.reset(allocateFrozenNodes(counts.nodes + 1));
+    result.leaves.reserve(counts.leaves);
+
+    // The nodes in breadth-first order, with NULL standing for the table.
+    // Visiting a node appends its child nodes, so they're numbered
+    // consecutively.
+    std::vector<const HamtNode *> queue;
+    queue.reserve(counts.nodes + 1);
+    queue.push_back(NULL);
+
+    for (size_t i = 0; i < queue.size(); ++i) {
+        FrozenHamtNode &frozen = result.nodes[i];
+        frozen.nodeMap = 0;
+        frozen.leafMap = 0;
+        frozen.firstNode = queue.size();
+        frozen.firstLeaf = result.leaves.size();
+
+        auto visit = [&](uint64_t idx, const HamtNodeEntry &entry) {
+            if (entry.isNull()) {
+                return;
+            } else if (entry.isLeaf()) {
+                const HamtLeaf &leaf = entry.getLeaf();
+                assert(leaf.length < UINT32_MAX);
+                frozen.leafMap |= 1ULL << idx;
+                result.leaves.push_back(
+                    {result.blob.size(), (uint32_t)leaf.length,
+                     (uint32_t)(leaf.hash >> BITS_PER_LEVEL)});
+                std::string_view key = leaf.key();
+                result.blob.insert(result.blob.end(), key.begin(), key.end());
+            } else {
+                frozen.nodeMap |= 1ULL << idx;
+                queue.push_back(&entry.getChild());
+            }
+        };
+
+        if (queue[i] == NULL) {
+            for (uint64_t idx = 0; idx < MAX_IDX; ++idx) {
+                visit(idx, table[idx]);
+            }
+        } else {
+            // Children are sorted from high to low bits, so walk them
+            // backwards to go from low to high.
+            const HamtNode &node = *queue[i];
+            int child = node.numberOfChildren() - 1;
+            for (uint64_t map = node.map; map != 0; map &= map - 1) {
+                visit(__builtin_ctzll(map), node.children[child--]);
+            }
+        }
+    }
+
+    result.blob.shrink_to_fit();
+    return result;
+}
+
+FrozenHamt::FrozenHamt() : nodes(allocateFrozenNodes(1)) {
+    nodes[0] = FrozenHamtNode{0, 0, 1, 0};
+}
+
+FrozenHamt::FrozenHamt(FrozenHamt &&other) : FrozenHamt() {
+    *this = std::move(other);
+}
+
+FrozenHamt &FrozenHamt::operator=(FrozenHamt &&other) {
+    std::swap(nodes, other.nodes);
+    leaves.swap(other.leaves);
+    blob.swap(other.blob);
+    return *this;
+}
+
+void FrozenHamt::FreeDeleter::operator()(FrozenHamtNode *nodes) const {
+    free(nodes);
+}
+
+bool FrozenHamt::matches(uint32_t idx, uint64_t hash,
+                         const std::string &str) const {
+    const FrozenHamtLeaf &leaf = leaves[idx];
+    if (leaf.fingerprint != (uint32_t)(hash >> BITS_PER_LEVEL)) {
+        return false;
+    }
+    return std::string_view(blob.data() + leaf.offset, leaf.length) == str;
+}
+
+bool FrozenHamt::find(const std::string &str) const {
+    uint64_t hash = hasher(str);
+    const FrozenHamtNode *node = &nodes[0];
+    unsigned level = 0;
+
+    while (true) {
+        uint64_t bit = 1ULL << (hash & FIRST_N_BITS);
+        uint64_t below = bit - 1;
+
+        if (node->leafMap & bit) {
+            uint32_t idx =
+                node->firstLeaf + __builtin_popcountll(node->leafMap & below);
+            return matches(idx, hash, str);
+        } else if (!(node->nodeMap & bit)) {
+            return false;
+        }
+
+        node = &nodes[node->firstNode +
+                      __builtin_popcountll(node->nodeMap & below)];
+        level++;
+        hash = nextHash(hash, level, str);
+    }
+}
+
+// Batched lookups are interleaved in groups of this many keys.
+static constexpr size_t FROZEN_BATCH_SIZE = 16;
+
+// Marks a key in a batch that's known to be missing.
+static constexpr uint32_t NO_LEAF = UINT32_MAX;
+
+void FrozenHamt::find(const std::string *keys, size_t n, bool *found) const {
+    uint64_t hashes[FROZEN_BATCH_SIZE];
+    unsigned levels[FROZEN_BATCH_SIZE];
+    const FrozenHamtNode *at[FROZEN_BATCH_SIZE];
+    uint32_t leafIdx[FROZEN_BATCH_SIZE];
+
+    for (size_t start = 0; start < n; start += FROZEN_BATCH_SIZE) {
+        size_t count = std::min(FROZEN_BATCH_SIZE, n - start);
+        const std::string *batch = keys + start;
+
+        for (size_t i = 0; i < count; ++i) {
+            hashes[i] = hasher(batch[i]);
+            levels[i] = 0;
+            at[i] = &nodes[0];
+        }
+
+        // Take every unfinished lookup down one level per round, so that
+        // each key's next node has a round to arrive in the cache.
+        size_t remaining = count;
+        while (remaining > 0) {
+            for (size_t i = 0; i < count; ++i) {
+                const FrozenHamtNode *node = at[i];
+                if (node == NULL) {
+                    continue;
+                }
+
+                uint64_t bit = 1ULL << (hashes[i] & FIRST_N_BITS);
+                uint64_t below = bit - 1;
+
+                if (node->leafMap & bit) {
+                    leafIdx[i] = node->firstLeaf +
+                                 __builtin_popcountll(node->leafMap & below);
+                    __builtin_prefetch(&leaves[leafIdx[i]]);
+                } else if (node->nodeMap & bit) {
+                    at[i] = &nodes[node->firstNode +
+                                   __builtin_popcountll(node->nodeMap & below)];
+                    __builtin_prefetch(at[i]);
+                    levels[i]++;
+                    hashes[i] = nextHash(hashes[i], levels[i], batch[i]);
+                    continue;
+                } else {
+                    leafIdx[i] = NO_LEAF;
+                }
+
+                at[i] = NULL;
+                remaining--;
+            }
+        }
+
+        for (size_t i = 0; i < count; ++i) {
+            if (leafIdx[i] != NO_LEAF) {
+                __builtin_prefetch(&blob[leaves[leafIdx[i]].offset]);
+            }
+        }
+
+        for (size_t i = 0; i < count; ++i) {
+            found[start + i] = leafIdx[i] != NO_LEAF &&
+                               matches(leafIdx[i], hashes[i], batch[i]);
+        }
+    }
+}
+
+size_t FrozenHamt::size() const { return leaves.size(); }
+
+FrozenHamt::Iterator FrozenHamt::begin() const { return Iterator(this, 0); }
+
+FrozenHamt::Iterator FrozenHamt::end() const {
+    return Iterator(this, leaves.size());
+}
+
+FrozenHamt::Iterator::Iterator(const FrozenHamt *set, size_t idx)
+    : set(set), idx(idx) {}
+
+std::string_view FrozenHamt::Iterator::operator*() const {
+    const FrozenHamtLeaf &leaf = set->leaves[idx];
+    return std::string_view(set->blob.data() + leaf.offset, leaf.length);
+}
+
+FrozenHamt::Iterator &FrozenHamt::Iterator::operator++() {
+    idx++;
+    return *this;
+}
+
+bool FrozenHamt::Iterator::operator!=(const Iterator &other) const {
+    return idx != other.idx;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// HamtBatch method definitions.
+//
+
+void HamtBatch::insert(std::string str) {
+    changes.push_back({std::move(str), true});
+}
+
+void HamtBatch::erase(std::string str) {
+    changes.push_back({std::move(str), false});
+}
+
+size_t HamtBatch::size() const { return changes.size(); }
+
+void HamtBatch::clear() { changes.clear(); }
+
 //////////////////////////////////////////////////////////////////////////////
 // Hamt method definitions.
 //
 
+void Hamt::swap(Hamt &other) {
+    Hamt tmp(std::move(other));
+    other = std::move(*this);
+    *this = std::move(tmp);
+}
+
+void Hamt::clear(bool keepMemory) { root.clear(keepMemory); }
+
+void Hamt::compact() { root.compact(SIZE_MAX); }
+
+bool Hamt::compactStep(size_t budget) { return root.compact(budget); }
+
+void Hamt::clear(HamtReclaimer &reclaimer) {
+    reclaimer.retire(std::move(*this));
+}
+
+HamtHandle Hamt::intern(std::string_view str) {
+    PROBE(HamtOperation::Insert);
+    uint64_t hash = hasher(str);
+    return HamtHandle(&root.insert(hash, str));
+}
+
 void Hamt::insert(std::string &&str) {
+    PROBE(HamtOperation::Insert);
     uint64_t hash = hasher(str);
-    root.insert(hash, std::move(str));
+    root.insert(hash, str);
 }
 
 bool Hamt::find(const std::string &str) const {
+    PROBE(HamtOperation::Find);
     uint64_t hash = hasher(str);
-    return root.find(hash, str);
+    return root.find(hash, str) != NULL;
 }
 
 bool Hamt::erase(const std::string &str) {
+    PROBE(HamtOperation::Erase);
     uint64_t hash = hasher(str);
     return root.erase(hash, str);
 }
 
+size_t Hamt::eraseIf(const std::function<bool(std::string_view)> &pred,
+                     unsigned threads) {
+    return root.eraseIf(pred, threads);
+}
+
+size_t Hamt::retainIf(const std::function<bool(std::string_view)> &pred,
+                      unsigned threads) {
+    return root.eraseIf([&pred](std::string_view key) { return !pred(key); },
+                        threads);
+}
+
+size_t Hamt::eraseBatch(const std::string *keys, size_t n, unsigned threads) {
+    std::vector<TopLevelHamtNode::BatchKey> batch;
+    batch.reserve(n);
+    for (size_t i = 0; i < n; ++i) {
+        batch.push_back({keys[i], hasher(keys[i])});
+    }
+    return root.eraseBatch(batch, threads);
+}
+
+void Hamt::apply(HamtBatch &&batch) {
+    std::vector<TopLevelHamtNode::BatchChange> changes;
+    changes.reserve(batch.changes.size());
+    for (const auto &change : batch.changes) {
+        changes.push_back(
+            {change.str, hasher(change.str), change.insert, NULL});
+    }
+    root.apply(changes);
+    batch.clear();
+}
+
+size_t Hamt::size() const { return root.size(); }
+
+void Hamt::reserve(size_t n, size_t averageLength) {
+    root.reserve(n, averageLength);
+}
+
+HamtShape Hamt::shape() const { return root.shape(); }
+
+size_t Hamt::approximateRank(uint64_t hash, unsigned levels) const {
+    return root.approximateRank(hash, levels);
+}
+
+FrozenHamt Hamt::freeze() const { return root.freeze(); }
+
+//////////////////////////////////////////////////////////////////////////////
+// CountingHamt method definitions.
+//
+
+CountingHamt::CountingHamt() : root(true) {}
+
+uint64_t CountingHamt::add(std::string_view str, uint64_t delta) {
+    if (delta == 0) {
+        return count(str);
+    }
+    PROBE(HamtOperation::Insert);
+    uint64_t hash = hasher(str);
+    auto &leaf = static_cast<HamtCountedLeaf &>(root.insert(hash, str));
+    leaf.count += delta;
+    return leaf.count;
+}
+
+uint64_t CountingHamt::count(std::string_view str) const {
+    PROBE(HamtOperation::Find);
+    uint64_t hash = hasher(str);
+    auto leaf = static_cast<const HamtCountedLeaf *>(root.find(hash, str));
+    return leaf == NULL ? 0 : leaf->count;
+}
+
+uint64_t CountingHamt::remove(std::string_view str, uint64_t delta) {
+    PROBE(HamtOperation::Erase);
+    uint64_t hash = hasher(str);
+    uint64_t left = 0;
+    root.erase(hash, str, delta, &left);
+    return left;
+}
+
+size_t CountingHamt::size() const { return root.size(); }
+
+void CountingHamt::reserve(size_t n, size_t averageLength) {
+    root.reserve(n, averageLength);
+}
+
+void CountingHamt::clear(bool keepMemory) { root.clear(keepMemory); }
+
+HamtShape CountingHamt::shape() const { return root.shape(); }
+
+//////////////////////////////////////////////////////////////////////////////
+// HamtReclaimer method definitions.
+//
+
+HamtReclaimer::HamtReclaimer() : thread(&HamtReclaimer::run, this) {}
+
+HamtReclaimer::~HamtReclaimer() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_one();
+    thread.join();
+}
+
+void HamtReclaimer::retire(Hamt &&hamt) {
+    auto root = std::make_unique<TopLevelHamtNode>(std::move(hamt.root));
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        queue.push_back(std::move(root));
+    }
+    wake.notify_one();
+}
+
+void HamtReclaimer::drain() {
+    std::unique_lock<std::mutex> lock(mutex);
+    drained.wait(lock, [this]() { return queue.empty() && !busy; });
+}
+
+void HamtReclaimer::run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        wake.wait(lock, [this]() { return stopping || !queue.empty(); });
+        if (queue.empty()) {
+            return;
+        }
+
+        auto retired = std::move(queue);
+        queue.clear();
+        busy = true;
+
+        // Free outside the lock, so that retiring never waits on freeing.
+        lock.unlock();
+        retired.clear();
+        lock.lock();
+
+        busy = false;
+        drained.notify_all();
+    }
+}
+
 // Re-enable the warning we disabled at the start.
 // warning.
 #ifdef __GNUC__
@@ -42,6 +42,7 @@ def main():
     os.chdir("build")
     runWithFlags([])
     runWithFlags(["-DTEST_HASH"])
+    runWithFlags(["-DHAMT_STATS"])
 
 
 if __name__ == "__main__":
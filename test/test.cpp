@@ -2,6 +2,7 @@
 #include <iostream>
 #include <memory>
 #include <random>
+#include <unordered_map>
 #include <unordered_set>
 
 #include "HAMT.hh"
@@ -18,6 +19,31 @@ void require(bool b) {
 
 static auto generator = std::mt19937();
 
+// When not negative, the number of allocations to allow before the next one
+// fails, to test that a failed allocation leaves things as they were.
+static long allocationsLeft = -1;
+
+void *operator new(size_t size) {
+    if (allocationsLeft == 0) {
+        throw std::bad_alloc();
+    } else if (allocationsLeft > 0) {
+        allocationsLeft--;
+    }
+    void *memory = malloc(size);
+    if (memory == NULL) {
+        throw std::bad_alloc();
+    }
+    return memory;
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+    return malloc(size);
+}
+
+void operator delete(void *p) noexcept { free(p); }
+
+void operator delete(void *p, size_t) noexcept { free(p); }
+
 std::string random_string() {
     int length = generator() % 256;
     auto str = std::string(length, 0);
@@ -112,6 +138,787 @@ void collision() {
     require(hamt.find("aaa"));
 }
 
+bool sameShape(const HamtShape &a, const HamtShape &b) {
+    return a.leaves == b.leaves && a.nodes == b.nodes &&
+           a.singleChildNodes == b.singleChildNodes &&
+           a.maxDepth == b.maxDepth && a.totalDepth == b.totalDepth;
+}
+
+// Erasing keys should leave the trie as if they had never been inserted.
+void canonicalErase(int size) {
+    std::unordered_set<std::string> seen;
+    std::vector<std::string> keep;
+    std::vector<std::string> drop;
+    while ((int)drop.size() < size) {
+        auto str = random_string();
+        if (seen.insert(str).second) {
+            (keep.size() <= drop.size() ? keep : drop).push_back(str);
+        }
+    }
+
+    Hamt churned;
+    Hamt fresh;
+    for (int i = 0; i < size; ++i) {
+        churned.insert(std::string(keep[i]));
+        churned.insert(std::string(drop[i]));
+        fresh.insert(std::string(keep[i]));
+    }
+
+    for (const auto &str : drop) {
+        churned.erase(str);
+    }
+
+    for (const auto &str : keep) {
+        require(churned.find(str));
+    }
+    for (const auto &str : drop) {
+        require(!churned.find(str));
+    }
+
+    // With TEST_HASH every key collides, and leaves can't be pulled back up
+    // past the original hash.
+#ifndef TEST_HASH
+    require(sameShape(churned.shape(), fresh.shape()));
+#endif
+    require(churned.shape().leaves == fresh.shape().leaves);
+}
+
+void clearAndReclaim() {
+    std::vector<std::string> keys;
+    for (int i = 0; i < 1000; ++i) {
+        keys.push_back(std::to_string(i));
+    }
+
+    Hamt hamt;
+    for (int round = 0; round < 2; ++round) {
+        for (const auto &key : keys) {
+            hamt.insert(std::string(key));
+        }
+        hamt.clear(round == 0);
+        for (const auto &key : keys) {
+            require(!hamt.find(key));
+        }
+    }
+
+    // Reuse memory kept by clear().
+    for (const auto &key : keys) {
+        hamt.insert(std::string(key));
+    }
+    hamt.clear(true);
+    for (const auto &key : keys) {
+        hamt.insert(std::string(key));
+    }
+    for (const auto &key : keys) {
+        require(hamt.find(key));
+    }
+
+    Hamt other;
+    other.insert("other");
+    hamt.swap(other);
+    require(hamt.find("other"));
+    require(!hamt.find("0"));
+    require(other.find("0"));
+
+    HamtReclaimer reclaimer;
+    other.clear(reclaimer);
+    require(!other.find("0"));
+    other.insert("0");
+    require(other.find("0"));
+    reclaimer.retire(std::move(hamt));
+    require(!hamt.find("other"));
+    reclaimer.drain();
+}
+
+// Keys sharing a long prefix make for a very deep trie when every hash
+// collides. Destroying or emptying it shouldn't recurse.
+void deepTeardown() {
+    std::string prefix(20000, 'a');
+    Hamt hamt;
+    hamt.insert(prefix + "b");
+    hamt.insert(prefix + "c");
+    require(hamt.find(prefix + "b"));
+    require(hamt.find(prefix + "c"));
+
+    Hamt erased;
+    erased.insert(prefix + "b");
+    erased.insert(prefix + "c");
+    require(erased.erase(prefix + "b"));
+    require(erased.erase(prefix + "c"));
+    require(!erased.find(prefix + "c"));
+
+    // With a sibling beside the chain, dropping it rebuilds the node above
+    // rather than freeing it.
+    Hamt sibling;
+    sibling.insert("b");
+    sibling.insert(prefix + "b");
+    sibling.insert(prefix + "c");
+    require(sibling.erase(prefix + "b"));
+    require(sibling.erase(prefix + "c"));
+    require(sibling.find("b") && sibling.size() == 1);
+
+    sibling.insert(prefix + "b");
+    sibling.insert(prefix + "c");
+    require(sibling.eraseIf(
+                [](std::string_view key) { return key.size() > 1; }) == 2);
+    require(sibling.find("b") && sibling.size() == 1);
+
+    std::string keys[] = {prefix + "b", prefix + "c"};
+    sibling.insert(std::string(keys[0]));
+    sibling.insert(std::string(keys[1]));
+    require(sibling.eraseBatch(keys, 2) == 2);
+    require(sibling.find("b") && sibling.size() == 1);
+
+    Hamt batched;
+    HamtBatch batch;
+    batch.insert(prefix + "b");
+    batch.insert(prefix + "c");
+    batched.apply(std::move(batch));
+    require(batched.find(prefix + "b"));
+    require(batched.find(prefix + "c"));
+    batch.erase(prefix + "b");
+    batched.apply(std::move(batch));
+    require(!batched.find(prefix + "b"));
+    require(batched.find(prefix + "c"));
+    batch.insert("b");
+    batched.apply(std::move(batch));
+    batch.erase(prefix + "c");
+    batched.apply(std::move(batch));
+    require(batched.find("b") && batched.size() == 1);
+}
+
+// Compact in small slices while the set changes underneath.
+void compaction() {
+    std::unordered_set<std::string> expected;
+    Hamt hamt;
+    for (int i = 0; i < 5000; ++i) {
+        auto str = random_string();
+        expected.insert(str);
+        hamt.insert(std::move(str));
+    }
+
+    for (int round = 0; round < 3; ++round) {
+        bool done = false;
+        while (!done) {
+            done = hamt.compactStep(100);
+
+            for (int i = 0; i < 20; ++i) {
+                auto str = random_string();
+                expected.insert(str);
+                hamt.insert(std::move(str));
+            }
+            for (int i = 0; i < 10 && !expected.empty(); ++i) {
+                auto str = *expected.begin();
+                expected.erase(expected.begin());
+                require(hamt.erase(str));
+            }
+        }
+
+        for (const auto &str : expected) {
+            require(hamt.find(str));
+        }
+    }
+
+    hamt.compact();
+    for (const auto &str : expected) {
+        require(hamt.find(str));
+    }
+
+    // Compacted nodes must survive being moved, cleared and regrown.
+    Hamt moved(std::move(hamt));
+    for (const auto &str : expected) {
+        require(moved.find(str));
+    }
+    moved.clear(true);
+    for (const auto &str : expected) {
+        require(!moved.find(str));
+        moved.insert(std::string(str));
+    }
+    moved.compact();
+    for (const auto &str : expected) {
+        require(moved.erase(str));
+    }
+}
+
+// A frozen copy should hold exactly the keys of the set it came from.
+void freezing(int size) {
+    std::unordered_set<std::string> present;
+    std::vector<std::string> absent;
+    Hamt hamt;
+    require(hamt.freeze().size() == 0);
+
+    while ((int)absent.size() < size) {
+        auto str = random_string();
+        if (present.count(str) != 0) {
+            continue;
+        } else if (present.size() <= absent.size()) {
+            present.insert(str);
+            hamt.insert(std::move(str));
+        } else {
+            absent.push_back(str);
+        }
+    }
+    for (int i = 0; i < size / 4; ++i) {
+        auto str = *present.begin();
+        present.erase(present.begin());
+        require(hamt.erase(str));
+        absent.push_back(str);
+    }
+
+    FrozenHamt frozen = hamt.freeze();
+    require(frozen.size() == present.size());
+
+    std::vector<std::string> keys(present.begin(), present.end());
+    keys.insert(keys.end(), absent.begin(), absent.end());
+    std::shuffle(keys.begin(), keys.end(), generator);
+    std::unique_ptr<bool[]> found(new bool[keys.size()]);
+    frozen.find(keys.data(), keys.size(), found.get());
+    for (size_t i = 0; i < keys.size(); ++i) {
+        require(frozen.find(keys[i]) == (present.count(keys[i]) != 0));
+        require(found[i] == (present.count(keys[i]) != 0));
+    }
+
+    std::unordered_set<std::string> iterated;
+    for (auto str : frozen) {
+        require(iterated.insert(std::string(str)).second);
+    }
+    require(iterated == present);
+
+    FrozenHamt moved(std::move(frozen));
+    require(frozen.size() == 0);
+    require(present.empty() || moved.find(*present.begin()));
+}
+
+// Interning a string twice should give the same handle, however the trie
+// changes in between.
+void interning() {
+    std::vector<std::string> keys;
+    std::vector<HamtHandle> handles;
+    std::vector<std::string_view> views;
+    Hamt hamt;
+    for (int i = 0; i < 2000; ++i) {
+        keys.push_back(random_string());
+        handles.push_back(hamt.intern(keys.back()));
+        views.push_back(handles.back().str());
+        require(handles.back() && handles.back().str() == keys.back());
+    }
+
+    std::unordered_set<HamtHandle> distinct(handles.begin(), handles.end());
+    std::unordered_set<std::string> distinctKeys(keys.begin(), keys.end());
+    require(distinct.size() == distinctKeys.size());
+
+    // Handles survive erasing other keys (which moves leaves up the trie)
+    // and compaction.
+    std::unordered_set<std::string> erased;
+    for (size_t i = 0; i < keys.size(); i += 2) {
+        if (erased.insert(keys[i]).second) {
+            require(hamt.erase(keys[i]));
+        }
+    }
+    hamt.compact();
+
+    // Strings never move, so even views of them stay put.
+    for (size_t i = 0; i < keys.size(); ++i) {
+        if (erased.count(keys[i]) == 0) {
+            require(handles[i].str() == keys[i]);
+            require(views[i] == keys[i]);
+            require(hamt.intern(keys[i]) == handles[i]);
+        }
+    }
+
+    hamt.insert("inserted");
+    require(hamt.intern("inserted") == hamt.intern(std::string("inserted")));
+    require(hamt.intern("inserted") != hamt.intern("interned"));
+    require(!HamtHandle());
+}
+
+// Keys, up to a few megabytes of them, are kept with their leaves. Erasing
+// most of them mustn't disturb the rest, nor their handles.
+void keyStorage() {
+    std::vector<std::string> keys;
+    for (int i = 0; i < 30000; ++i) {
+        keys.push_back(std::to_string(i) + std::string(100, 'k'));
+    }
+    keys.push_back(std::string(3 << 20, 'h'));
+
+    Hamt hamt;
+    std::vector<HamtHandle> handles;
+    for (const auto &key : keys) {
+        handles.push_back(hamt.intern(key));
+    }
+
+    for (size_t i = 0; i < keys.size(); ++i) {
+        if (i % 4 != 0) {
+            require(hamt.erase(keys[i]));
+        }
+    }
+
+    for (size_t i = 0; i < keys.size(); ++i) {
+        require(hamt.find(keys[i]) == (i % 4 == 0));
+        if (i % 4 == 0) {
+            require(handles[i].str() == keys[i]);
+        }
+    }
+
+    for (size_t i = 0; i < keys.size(); i += 4) {
+        require(hamt.erase(keys[i]));
+    }
+    for (const auto &key : keys) {
+        require(!hamt.find(key));
+        hamt.insert(std::string(key));
+    }
+    for (const auto &key : keys) {
+        require(hamt.find(key));
+    }
+}
+
+// Bulk erases should leave the same set, in the same canonical trie, as
+// erasing the strings one by one.
+void bulkErase(int size, unsigned threads) {
+    std::unordered_set<std::string> seen;
+    std::vector<std::string> keys;
+    while ((int)keys.size() < size) {
+        auto str = random_string();
+        if (seen.insert(str).second) {
+            keys.push_back(str);
+        }
+    }
+
+    auto build = [&]() {
+        Hamt hamt;
+        for (const auto &key : keys) {
+            hamt.insert(std::string(key));
+        }
+        return hamt;
+    };
+
+    // Erase by predicate, then by batch (with absent and repeated keys), and
+    // keep only what's left.
+    auto odd = [](std::string_view key) { return key.size() % 2 == 1; };
+    std::vector<std::string> batch;
+    for (int i = 0; i < size; i += 3) {
+        batch.push_back(keys[i]);
+        batch.push_back(keys[i]);
+        batch.push_back(random_string());
+    }
+    auto third = [](std::string_view key) { return key.size() % 3 != 0; };
+
+    Hamt bulk = build();
+    Hamt single = build();
+
+    size_t expected = 0;
+    for (const auto &key : keys) {
+        if (odd(key)) {
+            expected += single.erase(key);
+        }
+    }
+    require(bulk.eraseIf(odd, threads) == expected);
+
+    expected = 0;
+    for (const auto &key : batch) {
+        expected += single.erase(key);
+    }
+    require(bulk.eraseBatch(batch.data(), batch.size(), threads) == expected);
+
+    expected = 0;
+    for (const auto &key : keys) {
+        if (!third(key)) {
+            expected += single.erase(key);
+        }
+    }
+    require(bulk.retainIf(third, threads) == expected);
+
+    for (const auto &key : keys) {
+        require(bulk.find(key) == single.find(key));
+    }
+    require(bulk.size() == single.size());
+#ifndef TEST_HASH
+    require(sameShape(bulk.shape(), single.shape()));
+#endif
+    require(bulk.shape().leaves == single.shape().leaves);
+
+    require(bulk.eraseIf([](std::string_view) { return true; }, threads) ==
+            single.shape().leaves);
+    require(bulk.shape().nodes == 0 && bulk.shape().leaves == 0);
+}
+
+// A reserved HAMT should hold the same set, in the same trie, as one that
+// wasn't, and keep count of its strings throughout.
+void reserving(int size) {
+    std::unordered_set<std::string> seen;
+    std::vector<std::string> keys;
+    while ((int)keys.size() < size) {
+        auto str = random_string();
+        if (seen.insert(str).second) {
+            keys.push_back(str);
+        }
+    }
+
+    Hamt reserved;
+    Hamt plain;
+    reserved.reserve(size / 2);
+    for (int i = 0; i < size; ++i) {
+        reserved.insert(std::string(keys[i]));
+        plain.insert(std::string(keys[i]));
+        require(reserved.size() == (size_t)i + 1);
+        if (i == size / 2) {
+            // Now the length of the strings can be estimated.
+            reserved.reserve(size);
+        }
+    }
+    HamtHandle handle = reserved.intern(keys[0]);
+    require(reserved.size() == keys.size());
+
+#ifndef TEST_HASH
+    require(sameShape(reserved.shape(), plain.shape()));
+#endif
+    for (const auto &key : keys) {
+        require(reserved.find(key));
+    }
+
+    // Reserving less than the set holds does nothing.
+    reserved.reserve(1);
+    require(reserved.size() == keys.size());
+
+    size_t left = keys.size();
+    for (int i = 1; i < size; i += 2) {
+        require(reserved.erase(keys[i]));
+        require(!reserved.erase(keys[i]));
+        require(reserved.size() == --left);
+    }
+    left -= reserved.eraseIf(
+        [](std::string_view key) { return key.size() % 3 == 0; });
+    require(reserved.size() == left);
+    left -= reserved.eraseBatch(keys.data(), keys.size() / 2);
+    require(reserved.size() == left);
+    require(reserved.size() == reserved.shape().leaves);
+    require(!reserved.find(keys[0]) || handle.str() == keys[0]);
+
+    Hamt moved(std::move(reserved));
+    require(moved.size() == left);
+    require(reserved.size() == 0);
+
+    // Clearing while keeping memory reuses the reserved leaves.
+    moved.clear(true);
+    require(moved.size() == 0);
+    for (const auto &key : keys) {
+        moved.insert(std::string(key));
+    }
+    require(moved.size() == keys.size());
+    for (const auto &key : keys) {
+        require(moved.find(key));
+    }
+    moved.clear();
+    require(moved.size() == 0 && moved.shape().leaves == 0);
+}
+
+// Reserving for a large set should fill the pool with nodes for the first
+// levels too, where every node has all its children.
+void reservingDense() {
+    TopLevelHamtNode root;
+    root.reserve(200000, 8);
+    require(root.nodePool().available(MAX_IDX) >= MAX_IDX);
+}
+
+// A CountingHamt should agree with a map of counts, and once every string's
+// count has gone, leave the same trie as a set of what's left.
+void counting(int size) {
+    std::vector<std::string> vocabulary;
+    std::unordered_set<std::string> seen;
+    while ((int)vocabulary.size() < size) {
+        auto str = random_string();
+        if (seen.insert(str).second) {
+            vocabulary.push_back(str);
+        }
+    }
+
+    CountingHamt counts;
+    std::unordered_map<std::string, uint64_t> expected;
+    for (int i = 0; i < 4 * size; ++i) {
+        const auto &word = vocabulary[generator() % size];
+        uint64_t delta = generator() % 3 + 1;
+        require(counts.add(word, delta) == (expected[word] += delta));
+    }
+    require(counts.size() == expected.size());
+    require(counts.add("not a word", 0) == 0);
+    require(counts.count("not a word") == 0);
+    require(counts.remove("not a word") == 0);
+    require(counts.size() == expected.size());
+
+    for (const auto &word : vocabulary) {
+        require(counts.count(word) == expected[word]);
+    }
+
+    // Take every other word away a little at a time, and then altogether.
+    Hamt remaining;
+    for (int i = 0; i < size; ++i) {
+        const auto &word = vocabulary[i];
+        uint64_t &count = expected[word];
+        if (i % 2 == 0) {
+            if (count != 0) {
+                remaining.insert(std::string(word));
+            }
+            continue;
+        }
+        while (count > 1) {
+            require(counts.remove(word) == --count);
+        }
+        require(counts.remove(word, 5) == 0);
+        count = 0;
+        require(counts.count(word) == 0);
+    }
+
+    require(counts.size() == remaining.size());
+    for (const auto &word : vocabulary) {
+        require(counts.count(word) == expected[word]);
+    }
+#ifndef TEST_HASH
+    require(sameShape(counts.shape(), remaining.shape()));
+#endif
+
+    counts.clear();
+    require(counts.size() == 0 && counts.count(vocabulary[0]) == 0);
+}
+
+// Sampling every string should give back the whole set, which holds only if
+// every node's count of the strings under it is right.
+void requireSamplesAll(const Hamt &hamt,
+                       const std::unordered_set<std::string> &present) {
+    require(hamt.size() == present.size());
+    auto all = hamt.sample(generator, present.size() + 1);
+    std::unordered_set<std::string> drawn(all.begin(), all.end());
+    require(all.size() == present.size());
+    require(drawn == present);
+
+    auto some = hamt.sample(generator, 3);
+    require(some.size() == std::min<size_t>(3, present.size()));
+    for (const auto &str : some) {
+        require(present.count(str) == 1);
+    }
+}
+
+// Whether hash `a` comes before `b` in the trie's order, lowest index first.
+bool hashBefore(uint64_t a, uint64_t b) {
+    if (a == b) {
+        return false;
+    }
+    unsigned shift = __builtin_ctzll(a ^ b) / BITS_PER_LEVEL * BITS_PER_LEVEL;
+    return ((a >> shift) & FIRST_N_BITS) < ((b >> shift) & FIRST_N_BITS);
+}
+
+void sampling(int size) {
+    std::unordered_set<std::string> present;
+    std::vector<std::string> keys;
+    while ((int)keys.size() < size) {
+        auto str = random_string();
+        if (present.insert(str).second) {
+            keys.push_back(str);
+        }
+    }
+
+    Hamt hamt;
+    require(hamt.sample(generator, 5).empty());
+    for (const auto &key : keys) {
+        hamt.insert(std::string(key));
+    }
+    hamt.insert(std::string(keys[0]));
+    requireSamplesAll(hamt, present);
+
+    // Every way of erasing has to keep the counts up to date.
+    for (int i = 0; i < size; i += 4) {
+        require(hamt.erase(keys[i]));
+        present.erase(keys[i]);
+    }
+    requireSamplesAll(hamt, present);
+
+    auto odd = [](std::string_view key) { return key.size() % 2 == 1; };
+    hamt.eraseIf(odd);
+    for (const auto &key : keys) {
+        if (odd(key)) {
+            present.erase(key);
+        }
+    }
+    requireSamplesAll(hamt, present);
+
+    hamt.eraseBatch(keys.data() + 1, size / 4);
+    for (int i = 1; i < 1 + size / 4; ++i) {
+        present.erase(keys[i]);
+    }
+    requireSamplesAll(hamt, present);
+
+    for (int i = 0; i < size; i += 2) {
+        hamt.insert(std::string(keys[i]));
+        present.insert(keys[i]);
+    }
+    hamt.compact();
+    requireSamplesAll(hamt, present);
+
+#ifndef TEST_HASH
+    // Visiting every level, the rank is exact.
+    std::hash<std::string_view> hasher;
+    std::vector<uint64_t> probes;
+    for (const auto &key : keys) {
+        probes.push_back(hasher(key));
+        probes.push_back(hasher(key) ^ (generator() & 0xfff));
+    }
+    for (uint64_t probe : probes) {
+        size_t expected = 0;
+        for (const auto &str : present) {
+            expected += hashBefore(hasher(str), probe);
+        }
+        require(hamt.approximateRank(probe, LEVELS_PER_HASH) == expected);
+        require(hamt.approximateRank(probe) <= hamt.size());
+    }
+    require(hamt.approximateRank(0) == 0);
+#endif
+
+    // Each of a few strings should be drawn about as often as the others.
+    Hamt few;
+    for (int i = 0; i < 8 && i < size; ++i) {
+        few.insert(std::string(keys[i]));
+    }
+    std::unordered_map<std::string, int> draws;
+    for (int i = 0; i < 800 * (int)few.size(); ++i) {
+        draws[few.sample(generator, 1).at(0)]++;
+    }
+    require(draws.size() == few.size());
+    for (const auto &drawn : draws) {
+        require(drawn.second > 600 && drawn.second < 1000);
+    }
+}
+
+// Applying a batch should leave the set, and the trie, just as making its
+// changes one at a time would, or, if an allocation fails, just as it was.
+void applying(int size) {
+    std::unordered_set<std::string> seen;
+    std::vector<std::string> keys;
+    while ((int)keys.size() < 2 * size) {
+        auto str = random_string();
+        if (seen.insert(str).second) {
+            keys.push_back(str);
+        }
+    }
+
+    Hamt batched;
+    Hamt single;
+    for (int i = 0; i < size; ++i) {
+        batched.insert(std::string(keys[i]));
+        single.insert(std::string(keys[i]));
+    }
+    HamtHandle handle = batched.intern(keys[size - 1]);
+
+    // Erase some of the strings in the set, insert others again, and insert
+    // new strings, some of them more than once, or then erase them again.
+    HamtBatch batch;
+    std::vector<std::pair<std::string, bool>> changes;
+    for (int i = 0; i < size - 1; ++i) {
+        if (i % 3 == 0) {
+            changes.push_back({keys[i], false});
+        } else if (i % 3 == 1) {
+            changes.push_back({keys[i], true});
+        }
+        changes.push_back({keys[size + i], true});
+        if (i % 4 == 0) {
+            changes.push_back({keys[size + i], i % 8 == 0});
+        }
+    }
+    std::shuffle(changes.begin(), changes.end(), generator);
+    for (const auto &change : changes) {
+        if (change.second) {
+            batch.insert(change.first);
+            single.insert(std::string(change.first));
+        } else {
+            batch.erase(change.first);
+            single.erase(change.first);
+        }
+    }
+
+    // Try failing each allocation in turn until the batch goes through.
+    HamtShape before = batched.shape();
+    for (long allowed = 0;; ++allowed) {
+        HamtBatch attempt = batch;
+        allocationsLeft = allowed;
+        try {
+            batched.apply(std::move(attempt));
+            allocationsLeft = -1;
+            require(attempt.size() == 0);
+            break;
+        } catch (const std::bad_alloc &) {
+            allocationsLeft = -1;
+        }
+
+        require(sameShape(batched.shape(), before));
+        require(batched.size() == (size_t)size);
+        for (int i = 0; i < 2 * size; ++i) {
+            require(batched.find(keys[i]) == (i < size));
+        }
+        if (size > 100) {
+            allowed += allowed / 8;
+        }
+    }
+
+    for (const auto &key : keys) {
+        require(batched.find(key) == single.find(key));
+    }
+    require(batched.size() == single.size());
+#ifndef TEST_HASH
+    require(sameShape(batched.shape(), single.shape()));
+#endif
+    require(batched.shape().leaves == single.shape().leaves);
+    require(handle.str() == keys[size - 1]);
+    require(batched.intern(keys[size - 1]) == handle);
+
+    std::unordered_set<std::string> present;
+    for (const auto &key : keys) {
+        if (single.find(key)) {
+            present.insert(key);
+        }
+    }
+    requireSamplesAll(batched, present);
+
+    // Erasing everything leaves an empty trie.
+    HamtBatch all;
+    for (const auto &key : keys) {
+        all.erase(key);
+    }
+    batched.apply(std::move(all));
+    require(batched.size() == 0);
+    require(batched.shape().nodes == 0 && batched.shape().leaves == 0);
+}
+
+#ifdef HAMT_STATS
+static int samples = 0;
+
+void countSample(HamtOperation, std::uint64_t, void *) { samples++; }
+
+void counters() {
+    Hamt hamt;
+    hamtResetCounters();
+    hamtSetLatencySampler(countSample, NULL, 2);
+
+    for (int i = 0; i < 100; ++i) {
+        hamt.insert(std::to_string(i));
+    }
+    for (int i = 0; i < 100; ++i) {
+        require(hamt.find(std::to_string(i)));
+    }
+
+    hamtSetLatencySampler(NULL, NULL, 0);
+
+    const HamtCounters &c = hamtCounters();
+    require(c.operations == 200);
+    require(samples == 100);
+    require(c.levelsTraversed > 0);
+    require(c.nodeReallocations > 0);
+    require(c.stringComparisons >= 100);
+#ifdef TEST_HASH
+    require(c.backupHashes > 0);
+#endif
+
+    hamtResetCounters();
+    require(hamtCounters().operations == 0);
+}
+#endif
+
 int main(void) {
     runTest(1);
     runTest(2);
@@ -120,5 +927,34 @@ int main(void) {
     runTest(1000);
     runTest(10000);
     collision();
+    canonicalErase(10);
+    canonicalErase(1000);
+    canonicalErase(10000);
+    clearAndReclaim();
+    compaction();
+    freezing(1);
+    freezing(100);
+    freezing(10000);
+    interning();
+    keyStorage();
+    bulkErase(10, 1);
+    bulkErase(10000, 1);
+    bulkErase(10000, 4);
+    reserving(10);
+    reserving(10000);
+    reservingDense();
+    counting(10);
+    counting(10000);
+    sampling(10);
+    sampling(3000);
+    applying(2);
+    applying(100);
+    applying(3000);
+#ifdef TEST_HASH
+    deepTeardown();
+#endif
+#ifdef HAMT_STATS
+    counters();
+#endif
     return 0;
 }